@@ -0,0 +1,1304 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <limits.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "library.h"
+
+#define MAXKEYS 64      // Most distinct keys kept for songs
+#define MAXARGS 8       // Most arguments in a command that can be answered
+#define NONE UINT32_MAX // No value, sorted as ""
+#define TRIBITS 18      // Trigrams are hashed into 1 << TRIBITS lists of strings
+
+/**
+ * Each song is a run of key/value pairs in the order MPD sent them, since
+ * tags like Artist can repeat. Values are interned, so a song costs little
+ * more than a byte and a string id per tag
+ */
+struct library {
+  char *text;                   // Interned strings, each followed by a nul
+  size_t textlen, textsize;
+  uint32_t *str;                // Offset of each string in text
+  uint8_t *strtag;              // Set if a string is ever a tag's value, so "any" can match it
+  uint32_t nstr, strsize;
+  uint32_t *hash;               // String id + 1 or 0 for empty, only while loading
+  uint32_t hashsize;
+  char *keys[MAXKEYS];
+  uint8_t keytag[MAXKEYS];      // Set if the key is a tag, which "any" matches
+  int nkeys;
+  uint8_t *pairkey;
+  uint32_t *pairval;
+  size_t npairs, pairsize;
+  uint32_t *track;              // First pair of each song
+  uint32_t *duration;           // Milliseconds
+  uint32_t ntracks, tracksize;
+  int skip;                     // In a directory or playlist entry
+  uint32_t *trifirst;           // Where each trigram's list starts in triids ...
+  uint32_t *triids;             // ... of the tag values with it, in lower case
+  uint32_t ntriids;
+  uint32_t *valfirst;           // Where each string's list starts in valtracks ...
+  uint32_t *valtracks;          // ... of the songs that have it as a tag value
+  uint32_t nvaltracks;
+  uint32_t **perms;             // Song order for each sort, made when first asked for
+  char *lastquery;              // Filter and sort of the last search ...
+  uint32_t *result, nresult;    // ... and the songs it found, for its next window
+  char *line;
+  size_t linesize;
+  uint32_t *filehash;           // Song + 1 or 0 for empty, by file, made when first needed
+  uint32_t filehashsize;
+  void *map;                    // The snapshot everything's in, if opened from one
+  size_t maplen;
+};
+
+/**
+ * Start of a snapshot file, followed by each array, in the order
+ * lib_sections() lists them, each padded to a multiple of 8 bytes
+ */
+struct lib_header {
+  char magic[8];
+  uint64_t stamp;               // Given to library_save(), MPD's db_update
+  uint64_t textlen, nstr, npairs, ntracks, ntriids, nvaltracks, nkeys, keyslen, tribits;
+};
+#define MAGIC "MPDQLIB1"
+#define NSECTIONS 13
+
+/**
+ * Sort orders: the name given to "sort", then the keys to take the value
+ * from, the first a song has, as MPD falls back for them
+ */
+static const struct {
+  const char *name;
+  const char *keys[4];
+  int numeric;                  // 1 to compare as integers, as MPD does for Track and Disc, 2 as seconds
+} sorts[] = {
+  { "Artist", { "Artist" }, 0 },
+  { "ArtistSort", { "ArtistSort", "Artist" }, 0 },
+  { "Album", { "Album" }, 0 },
+  { "AlbumSort", { "AlbumSort", "Album" }, 0 },
+  { "AlbumArtist", { "AlbumArtist", "Artist" }, 0 },
+  { "AlbumArtistSort", { "AlbumArtistSort", "AlbumArtist", "ArtistSort", "Artist" }, 0 },
+  { "Title", { "Title" }, 0 },
+  { "TitleSort", { "TitleSort", "Title" }, 0 },
+  { "Track", { "Track" }, 1 },
+  { "Disc", { "Disc" }, 1 },
+  { "Name", { "Name" }, 0 },
+  { "Genre", { "Genre" }, 0 },
+  { "Date", { "Date" }, 0 },
+  { "OriginalDate", { "OriginalDate" }, 0 },
+  { "Composer", { "Composer" }, 0 },
+  { "ComposerSort", { "ComposerSort", "Composer" }, 0 },
+  { "Performer", { "Performer" }, 0 },
+  { "Conductor", { "Conductor" }, 0 },
+  { "Work", { "Work" }, 0 },
+  { "Grouping", { "Grouping" }, 0 },
+  { "Label", { "Label" }, 0 },
+  { "duration", { "duration", "Time" }, 2 },
+};
+#define NSORTS (sizeof(sorts) / sizeof(sorts[0]))
+
+// In perms for a sort that can't be answered here
+static uint32_t lib_unsorted[1];
+
+/**
+ * Keys that are information about the file rather than tags
+ */
+static const char *notags[] = { "file", "Last-Modified", "Added", "Format", "Time", "duration", "Range", NULL };
+
+#define F_AND 0
+#define F_NOT 1
+#define F_EQ 2
+#define F_CONTAINS 3
+#define F_STARTS 4
+
+struct filter {
+  int op;                       // F_AND, F_NOT, or a comparison
+  int key;                      // Key to compare, or -1 for any tag
+  int fallback[3];              // ... then the keys to compare if a song hasn't got it, or -1
+  int not;                      // "!=", true of a song with any value that isn't equal
+  char *value;                  // In lower case
+  struct filter *a, *b;
+};
+
+struct library *library_new(void) {
+  return calloc(sizeof(struct library), 1);
+}
+
+static uint32_t lib_hash(const char *s, size_t len) {
+  uint32_t h = 2166136261u;
+  for (size_t i=0;i<len;i++) {
+    h = (h ^ (unsigned char) s[i]) * 16777619u;
+  }
+  return h;
+}
+
+static void lib_rehash(struct library *lib) {
+  lib->hashsize = lib->hashsize ? lib->hashsize * 2 : 4096;
+  free(lib->hash);
+  lib->hash = calloc(lib->hashsize, sizeof(uint32_t));
+  for (uint32_t id=0;id<lib->nstr;id++) {
+    const char *s = lib->text + lib->str[id];
+    uint32_t h = lib_hash(s, strlen(s)) & (lib->hashsize - 1);
+    while (lib->hash[h]) {
+      h = (h + 1) & (lib->hashsize - 1);
+    }
+    lib->hash[h] = id + 1;
+  }
+}
+
+/**
+ * @return the id of the string, added if it's new
+ */
+static uint32_t lib_intern(struct library *lib, const char *s, size_t len) {
+  if (lib->nstr * 2 >= lib->hashsize) {
+    lib_rehash(lib);
+  }
+  uint32_t h = lib_hash(s, len) & (lib->hashsize - 1);
+  while (lib->hash[h]) {
+    uint32_t id = lib->hash[h] - 1;
+    const char *t = lib->text + lib->str[id];
+    if (!memcmp(t, s, len) && !t[len]) {
+      return id;
+    }
+    h = (h + 1) & (lib->hashsize - 1);
+  }
+  if (lib->textlen + len + 1 > lib->textsize) {
+    while (lib->textlen + len + 1 > lib->textsize) {
+      lib->textsize = lib->textsize ? lib->textsize * 2 : 65536;
+    }
+    lib->text = realloc(lib->text, lib->textsize);
+  }
+  if (lib->nstr == lib->strsize) {
+    lib->strsize = lib->strsize ? lib->strsize * 2 : 1024;
+    lib->str = realloc(lib->str, lib->strsize * sizeof(uint32_t));
+    lib->strtag = realloc(lib->strtag, lib->strsize);
+  }
+  memcpy(lib->text + lib->textlen, s, len);
+  lib->text[lib->textlen + len] = 0;
+  lib->str[lib->nstr] = lib->textlen;
+  lib->strtag[lib->nstr] = 0;
+  lib->textlen += len + 1;
+  lib->hash[h] = lib->nstr + 1;
+  return lib->nstr++;
+}
+
+/**
+ * Add a line of the answer to "listallinfo"
+ */
+void library_line(struct library *lib, const char *line, size_t len) {
+  const char *sep = memmem(line, len, ": ", 2);
+  if (!sep) {
+    return;
+  }
+  size_t klen = sep - line;
+  const char *value = sep + 2;
+  size_t vlen = len - klen - 2;
+  if (klen == 4 && !memcmp(line, "file", 4)) {
+    if (lib->ntracks == lib->tracksize) {
+      lib->tracksize = lib->tracksize ? lib->tracksize * 2 : 1024;
+      lib->track = realloc(lib->track, lib->tracksize * sizeof(uint32_t));
+      lib->duration = realloc(lib->duration, lib->tracksize * sizeof(uint32_t));
+    }
+    lib->track[lib->ntracks] = lib->npairs;
+    lib->duration[lib->ntracks++] = 0;
+    lib->skip = 0;
+    free(lib->filehash);
+    lib->filehash = NULL;
+  } else if ((klen == 9 && !memcmp(line, "directory", 9)) || (klen == 8 && !memcmp(line, "playlist", 8))) {
+    lib->skip = 1;
+  }
+  if (lib->skip || !lib->ntracks) {
+    return;
+  }
+  int key;
+  for (key=0;key<lib->nkeys;key++) {
+    if (!strncmp(lib->keys[key], line, klen) && !lib->keys[key][klen]) {
+      break;
+    }
+  }
+  if (key == lib->nkeys) {
+    if (key == MAXKEYS) {
+      return;
+    }
+    lib->keys[key] = strndup(line, klen);
+    lib->keytag[key] = 1;
+    for (int i=0;notags[i];i++) {
+      if (!strcmp(notags[i], lib->keys[key])) {
+        lib->keytag[key] = 0;
+      }
+    }
+    lib->nkeys++;
+  }
+  uint32_t id = lib_intern(lib, value, vlen);
+  if (lib->keytag[key]) {
+    lib->strtag[id] = 1;
+  }
+  if (lib->npairs == lib->pairsize) {
+    lib->pairsize = lib->pairsize ? lib->pairsize * 2 : 8192;
+    lib->pairkey = realloc(lib->pairkey, lib->pairsize);
+    lib->pairval = realloc(lib->pairval, lib->pairsize * sizeof(uint32_t));
+  }
+  lib->pairkey[lib->npairs] = key;
+  lib->pairval[lib->npairs++] = id;
+  if (!strcmp(lib->keys[key], "duration")) {
+    lib->duration[lib->ntracks - 1] = strtod(lib->text + lib->str[id], NULL) * 1000 + 0.5;
+  } else if (!strcmp(lib->keys[key], "Time") && !lib->duration[lib->ntracks - 1]) {
+    lib->duration[lib->ntracks - 1] = strtoul(lib->text + lib->str[id], NULL, 10) * 1000;
+  }
+}
+
+static inline char lib_lower(char ch) {
+  return ch >= 'A' && ch <= 'Z' ? ch + 32 : ch;
+}
+
+static inline uint32_t lib_trigram(const char *s) {
+  uint32_t h = ((uint32_t) (unsigned char) lib_lower(s[0]) << 16 | (unsigned char) lib_lower(s[1]) << 8 | (unsigned char) lib_lower(s[2])) * 2654435761u;
+  return h >> (32 - TRIBITS);
+}
+
+static inline uint32_t lib_end(const struct library *lib, uint32_t t) {
+  return t + 1 < lib->ntracks ? lib->track[t + 1] : lib->npairs;
+}
+
+static int lib_key(const struct library *lib, const char *name) {
+  for (int i=0;i<lib->nkeys;i++) {
+    if (!strcasecmp(lib->keys[i], name)) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+/**
+ * Index the tag values by their trigrams, and the songs by their tag values,
+ * so a filter only has to look at the values and songs it could match.
+ * Each list is made with two passes, counting then filling, and is in
+ * order since the strings and songs are visited in order
+ */
+static void lib_index(struct library *lib) {
+  uint32_t *last = malloc(((1 << TRIBITS) > lib->nstr ? (1 << TRIBITS) : lib->nstr) * sizeof(uint32_t));
+  lib->trifirst = calloc((1 << TRIBITS) + 1, sizeof(uint32_t));
+  for (int pass=0;pass<2;pass++) {
+    memset(last, 0, (1 << TRIBITS) * sizeof(uint32_t));
+    for (uint32_t id=0;id<lib->nstr;id++) {
+      const char *s = lib->text + lib->str[id];
+      // The last is the end of the string, so the strings a pair of
+      // characters ends can be found too
+      for (size_t i=0;lib->strtag[id] && s[i] && s[i + 1];i++) {
+        uint32_t tri = lib_trigram(s + i);
+        if (last[tri] != id + 1) {
+          // Once per string
+          last[tri] = id + 1;
+          if (pass) {
+            lib->triids[lib->trifirst[tri]++] = id;
+          } else {
+            lib->trifirst[tri + 1]++;
+          }
+        }
+      }
+    }
+    if (!pass) {
+      for (uint32_t tri=0;tri<(1 << TRIBITS);tri++) {
+        lib->trifirst[tri + 1] += lib->trifirst[tri];
+      }
+      lib->ntriids = lib->trifirst[1 << TRIBITS];
+      lib->triids = malloc((lib->ntriids ? lib->ntriids : 1) * sizeof(uint32_t));
+    }
+  }
+  // Filling moved each start on to the next one's
+  memmove(lib->trifirst + 1, lib->trifirst, (1 << TRIBITS) * sizeof(uint32_t));
+  lib->trifirst[0] = 0;
+  lib->valfirst = calloc(lib->nstr + 1, sizeof(uint32_t));
+  for (int pass=0;pass<2;pass++) {
+    memset(last, 0, lib->nstr * sizeof(uint32_t));
+    for (uint32_t t=0;t<lib->ntracks;t++) {
+      uint32_t end = lib_end(lib, t);
+      for (uint32_t i=lib->track[t];i<end;i++) {
+        uint32_t id = lib->pairval[i];
+        if (lib->keytag[lib->pairkey[i]] && last[id] != t + 1) {
+          last[id] = t + 1;
+          if (pass) {
+            lib->valtracks[lib->valfirst[id]++] = t;
+          } else {
+            lib->valfirst[id + 1]++;
+          }
+        }
+      }
+    }
+    if (!pass) {
+      for (uint32_t id=0;id<lib->nstr;id++) {
+        lib->valfirst[id + 1] += lib->valfirst[id];
+      }
+      lib->nvaltracks = lib->valfirst[lib->nstr];
+      lib->valtracks = malloc((lib->nvaltracks ? lib->nvaltracks : 1) * sizeof(uint32_t));
+    }
+  }
+  memmove(lib->valfirst + 1, lib->valfirst, lib->nstr * sizeof(uint32_t));
+  lib->valfirst[0] = 0;
+  free(last);
+}
+
+/**
+ * Called once the whole answer has been added, to give back what loading needed
+ */
+void library_done(struct library *lib) {
+  free(lib->hash);
+  lib->hash = NULL;
+  lib->hashsize = 0;
+  if (lib->textlen) {
+    lib->text = realloc(lib->text, lib->textsize = lib->textlen);
+  }
+  if (lib->nstr) {
+    lib->str = realloc(lib->str, (lib->strsize = lib->nstr) * sizeof(uint32_t));
+    lib->strtag = realloc(lib->strtag, lib->nstr);
+  }
+  if (lib->npairs) {
+    lib->pairkey = realloc(lib->pairkey, lib->pairsize = lib->npairs);
+    lib->pairval = realloc(lib->pairval, lib->npairs * sizeof(uint32_t));
+  }
+  if (lib->ntracks) {
+    lib->track = realloc(lib->track, (lib->tracksize = lib->ntracks) * sizeof(uint32_t));
+    lib->duration = realloc(lib->duration, lib->ntracks * sizeof(uint32_t));
+  }
+  lib->perms = calloc(NSORTS * 2, sizeof(uint32_t *));
+  lib_index(lib);
+}
+
+size_t library_tracks(const struct library *lib) {
+  return lib->ntracks;
+}
+
+size_t library_bytes(const struct library *lib) {
+  size_t bytes = sizeof(*lib) + lib->textsize + lib->strsize * 5 + lib->hashsize * 4 + lib->pairsize * 5 + lib->tracksize * 8 + lib->nresult * 4;
+  if (lib->trifirst) {
+    bytes += ((1 << TRIBITS) + 1 + lib->ntriids + lib->nstr + 1 + lib->nvaltracks) * 4;
+  }
+  for (size_t i=0;lib->perms && i<NSORTS * 2;i++) {
+    bytes += lib->perms[i] && lib->perms[i] != lib_unsorted ? lib->ntracks * 4 : 0;
+  }
+  return bytes;
+}
+
+static void lib_filter_free(struct filter *f) {
+  if (f) {
+    lib_filter_free(f->a);
+    lib_filter_free(f->b);
+    free(f->value);
+    free(f);
+  }
+}
+
+void library_free(struct library *lib) {
+  if (!lib) {
+    return;
+  }
+  for (size_t i=0;lib->perms && i<NSORTS * 2;i++) {
+    if (lib->perms[i] != lib_unsorted) {
+      free(lib->perms[i]);
+    }
+  }
+  free(lib->perms);
+  free(lib->filehash);
+  free(lib->lastquery);
+  free(lib->result);
+  free(lib->line);
+  if (lib->map) {
+    // Everything else is in the snapshot
+    munmap(lib->map, lib->maplen);
+    free(lib);
+    return;
+  }
+  for (int i=0;i<lib->nkeys;i++) {
+    free(lib->keys[i]);
+  }
+  free(lib->trifirst);
+  free(lib->triids);
+  free(lib->valfirst);
+  free(lib->valtracks);
+  free(lib->text);
+  free(lib->str);
+  free(lib->strtag);
+  free(lib->hash);
+  free(lib->pairkey);
+  free(lib->pairval);
+  free(lib->track);
+  free(lib->duration);
+  free(lib);
+}
+
+/**
+ * Find a song by its file, which is always its first pair
+ * @return the song, or NONE if it's not there
+ */
+static uint32_t lib_file(struct library *lib, const char *file, size_t len) {
+  if (!lib->filehash) {
+    for (lib->filehashsize=16;lib->filehashsize<lib->ntracks * 2;lib->filehashsize*=2) {
+    }
+    lib->filehash = calloc(lib->filehashsize, sizeof(uint32_t));
+    for (uint32_t t=0;t<lib->ntracks;t++) {
+      const char *s = lib->text + lib->str[lib->pairval[lib->track[t]]];
+      uint32_t h = lib_hash(s, strlen(s)) & (lib->filehashsize - 1);
+      while (lib->filehash[h]) {
+        h = (h + 1) & (lib->filehashsize - 1);
+      }
+      lib->filehash[h] = t + 1;
+    }
+  }
+  uint32_t h = lib_hash(file, len) & (lib->filehashsize - 1);
+  while (lib->filehash[h]) {
+    uint32_t t = lib->filehash[h] - 1;
+    const char *s = lib->text + lib->str[lib->pairval[lib->track[t]]];
+    if (!memcmp(s, file, len) && !s[len]) {
+      return t;
+    }
+    h = (h + 1) & (lib->filehashsize - 1);
+  }
+  return NONE;
+}
+
+static void lib_copy(struct library *dst, const struct library *src, uint32_t t) {
+  uint32_t end = lib_end(src, t);
+  for (uint32_t i=src->track[t];i<end;i++) {
+    const char *key = src->keys[src->pairkey[i]], *value = src->text + src->str[src->pairval[i]];
+    size_t klen = strlen(key), vlen = strlen(value);
+    if (klen + vlen + 2 > dst->linesize) {
+      dst->linesize = klen + vlen + 2;
+      dst->line = realloc(dst->line, dst->linesize);
+    }
+    memcpy(dst->line, key, klen);
+    memcpy(dst->line + klen, ": ", 2);
+    memcpy(dst->line + klen + 2, value, vlen);
+    library_line(dst, dst->line, klen + vlen + 2);
+  }
+}
+
+/**
+ * Add a song from another library, as if its lines had been read
+ * @param src may be NULL
+ * @return false if the song isn't in it
+ */
+int library_copy(struct library *dst, struct library *src, const char *file, size_t len) {
+  uint32_t t = src ? lib_file(src, file, len) : NONE;
+  if (t == NONE) {
+    return 0;
+  }
+  lib_copy(dst, src, t);
+  return 1;
+}
+
+/**
+ * Make a library with the songs of another in the same order, but taking
+ * each from a second library where it's there
+ */
+struct library *library_merge(struct library *order, struct library *changed) {
+  struct library *lib = library_new();
+  for (uint32_t t=0;t<order->ntracks;t++) {
+    const char *file = order->text + order->str[order->pairval[order->track[t]]];
+    if (!library_copy(lib, changed, file, strlen(file))) {
+      lib_copy(lib, order, t);
+    }
+  }
+  return lib;
+}
+
+/**
+ * Find the latest time a song was modified
+ * @return its length in buf, or 0 if no song has a time
+ */
+size_t library_modified(struct library *lib, char *buf, size_t len) {
+  int key = lib_key(lib, "Last-Modified");
+  const char *latest = "";
+  for (size_t i=0;key >= 0 && i<lib->npairs;i++) {
+    const char *s = lib->text + lib->str[lib->pairval[i]];
+    if (lib->pairkey[i] == key && strcmp(s, latest) > 0) {
+      latest = s;
+    }
+  }
+  return strlen(latest) < len ? (size_t) snprintf(buf, len, "%s", latest) : 0;
+}
+
+/**
+ * List where each array is and how long it is, in the order they're saved
+ * @param keys the names of the keys, one after another with their nuls
+ */
+static void lib_sections(struct library *lib, const struct lib_header *h, char *keys, void **ptr, size_t *len) {
+  void *p[NSECTIONS] = { keys, lib->keytag, lib->text, lib->str, lib->strtag, lib->pairkey, lib->pairval, lib->track, lib->duration, lib->trifirst, lib->triids, lib->valfirst, lib->valtracks };
+  size_t l[NSECTIONS] = { h->keyslen, MAXKEYS, h->textlen, h->nstr * 4, h->nstr, h->npairs, h->npairs * 4, h->ntracks * 4, h->ntracks * 4, ((1 << TRIBITS) + 1) * 4, h->ntriids * 4, (h->nstr + 1) * 4, h->nvaltracks * 4 };
+  memcpy(ptr, p, sizeof(p));
+  memcpy(len, l, sizeof(l));
+}
+
+/**
+ * Write the library to a file that library_open() can map, replacing it
+ * all at once so a reader never sees half of it
+ * @param stamp anything that changes when the library does
+ * @return 0, or -1 with errno set
+ */
+int library_save(struct library *lib, const char *path, unsigned long long stamp) {
+  struct lib_header h = { MAGIC, stamp, lib->textlen, lib->nstr, lib->npairs, lib->ntracks, lib->ntriids, lib->nvaltracks, lib->nkeys, 0, TRIBITS };
+  char *keys = NULL;
+  for (int i=0;i<lib->nkeys;i++) {
+    size_t len = strlen(lib->keys[i]) + 1;
+    keys = realloc(keys, h.keyslen + len);
+    memcpy(keys + h.keyslen, lib->keys[i], len);
+    h.keyslen += len;
+  }
+  void *ptr[NSECTIONS];
+  size_t len[NSECTIONS];
+  lib_sections(lib, &h, keys, ptr, len);
+  char *tmp = malloc(strlen(path) + 8);
+  sprintf(tmp, "%s.XXXXXX", path);
+  int fd = mkstemp(tmp);
+  FILE *f = fd < 0 ? NULL : fdopen(fd, "w");
+  int ok = f && fwrite(&h, sizeof(h), 1, f) == 1;
+  for (int i=0;ok && i<NSECTIONS;i++) {
+    static const char pad[8];
+    ok = (!len[i] || fwrite(ptr[i], len[i], 1, f) == 1) && fwrite(pad, (8 - len[i] % 8) % 8, 1, f) <= 1;
+  }
+  ok = f ? !fclose(f) && ok : 0;
+  if (ok && !rename(tmp, path)) {
+    ok = 1;
+  } else if (fd >= 0) {
+    unlink(tmp);
+    ok = 0;
+  }
+  free(tmp);
+  free(keys);
+  return ok ? 0 : -1;
+}
+
+/**
+ * Check every offset and count in a mapped snapshot is in range, so a
+ * truncated or corrupt file can't send a search outside the mapping
+ */
+static int lib_valid(const struct library *lib, const struct lib_header *h) {
+  if (h->nstr && (!h->textlen || lib->text[h->textlen - 1])) {
+    return 0;
+  }
+  for (uint32_t i=0;i<lib->nstr;i++) {
+    if (lib->str[i] >= h->textlen) {
+      return 0;
+    }
+  }
+  for (size_t i=0;i<lib->npairs;i++) {
+    if (lib->pairkey[i] >= h->nkeys || lib->pairval[i] >= lib->nstr) {
+      return 0;
+    }
+  }
+  for (uint32_t t=0;t<lib->ntracks;t++) {
+    if (lib->track[t] > lib_end(lib, t) || lib_end(lib, t) > lib->npairs) {
+      return 0;
+    }
+  }
+  for (uint32_t i=0;i<1 << TRIBITS;i++) {
+    if (lib->trifirst[i] > lib->trifirst[i + 1]) {
+      return 0;
+    }
+  }
+  for (uint32_t i=0;i<lib->nstr;i++) {
+    if (lib->valfirst[i] > lib->valfirst[i + 1]) {
+      return 0;
+    }
+  }
+  if (lib->trifirst[1 << TRIBITS] > lib->ntriids || lib->valfirst[lib->nstr] > lib->nvaltracks) {
+    return 0;
+  }
+  for (uint32_t i=0;i<lib->ntriids;i++) {
+    if (lib->triids[i] >= lib->nstr) {
+      return 0;
+    }
+  }
+  for (uint32_t i=0;i<lib->nvaltracks;i++) {
+    if (lib->valtracks[i] >= lib->ntracks) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/**
+ * Map a file written by library_save(), sharing its pages with every other
+ * thread and process that maps it. One that's damaged is deleted
+ * @return the library, or NULL if there's no file, it's for a different
+ * stamp or it's damaged
+ */
+struct library *library_open(const char *path, unsigned long long stamp) {
+  int fd = open(path, O_RDONLY);
+  struct stat st;
+  if (fd < 0) {
+    return NULL;
+  }
+  void *map = fstat(fd, &st) || (size_t) st.st_size < sizeof(struct lib_header) ? MAP_FAILED : mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    return NULL;
+  }
+  const struct lib_header *h = (const struct lib_header *) map;
+  struct library *lib = library_new();
+  lib->map = map;
+  lib->maplen = st.st_size;
+  if (memcmp(h->magic, MAGIC, 8) || h->stamp != stamp) {
+    library_free(lib);
+    return NULL;
+  }
+  // Each count must fit the arrays' 32 bit offsets before the sections'
+  // lengths can be worked out from them
+  if (h->tribits != TRIBITS || h->nkeys > MAXKEYS || h->textlen >= NONE || h->nstr >= NONE || h->npairs >= NONE || h->ntracks >= NONE || h->ntriids >= NONE || h->nvaltracks >= NONE || h->keyslen >= NONE) {
+    library_free(lib);
+    unlink(path);
+    return NULL;
+  }
+  void *ptr[NSECTIONS];
+  size_t len[NSECTIONS], off = sizeof(*h);
+  lib_sections(lib, h, NULL, ptr, len);
+  for (int i=0;i<NSECTIONS;i++) {
+    ptr[i] = (char *) map + off;
+    off += (len[i] + 7) / 8 * 8;
+  }
+  char *keys = ptr[0];
+  uint64_t nuls = 0;
+  for (uint64_t i=0;off == lib->maplen && i<h->keyslen;i++) {
+    nuls += !keys[i];
+  }
+  if (off != lib->maplen || (h->keyslen && keys[h->keyslen - 1]) || nuls < h->nkeys) {
+    library_free(lib);
+    unlink(path);
+    return NULL;
+  }
+  for (uint64_t i=0;i<h->nkeys;i++) {
+    lib->keys[i] = keys;
+    keys += strlen(keys) + 1;
+  }
+  lib->nkeys = h->nkeys;
+  memcpy(lib->keytag, ptr[1], MAXKEYS);
+  lib->text = ptr[2];
+  lib->str = ptr[3];
+  lib->strtag = ptr[4];
+  lib->pairkey = ptr[5];
+  lib->pairval = ptr[6];
+  lib->track = ptr[7];
+  lib->duration = ptr[8];
+  lib->trifirst = ptr[9];
+  lib->triids = ptr[10];
+  lib->valfirst = ptr[11];
+  lib->valtracks = ptr[12];
+  lib->textlen = lib->textsize = h->textlen;
+  lib->nstr = lib->strsize = h->nstr;
+  lib->npairs = lib->pairsize = h->npairs;
+  lib->ntracks = lib->tracksize = h->ntracks;
+  lib->ntriids = h->ntriids;
+  lib->nvaltracks = h->nvaltracks;
+  lib->perms = calloc(NSORTS * 2, sizeof(uint32_t *));
+  if (!lib_valid(lib, h)) {
+    library_free(lib);
+    unlink(path);
+    return NULL;
+  }
+  return lib;
+}
+
+/**
+ * Split a command into its arguments, unquoting them in place as MPD does
+ * @return how many there are, or -1 if there are too many or a quote isn't closed
+ */
+static int lib_args(char *s, char **argv, int max) {
+  int n = 0;
+  while (*s) {
+    if (*s == ' ' || *s == '\t') {
+      s++;
+      continue;
+    }
+    if (n == max) {
+      return -1;
+    }
+    if (*s == '"') {
+      char *t = ++s;
+      argv[n++] = t;
+      while (*s && *s != '"') {
+        if (*s == '\\' && s[1]) {
+          s++;
+        }
+        *t++ = *s++;
+      }
+      if (!*s) {
+        return -1;
+      }
+      *t = 0;
+      s++;
+    } else {
+      argv[n++] = s;
+      while (*s && *s != ' ' && *s != '\t') {
+        s++;
+      }
+      if (*s) {
+        *s++ = 0;
+      }
+    }
+  }
+  return n;
+}
+
+static const char *lib_space(const char *s) {
+  while (*s == ' ') {
+    s++;
+  }
+  return s;
+}
+
+/**
+ * Parse a filter expression, as far as one that can be answered here goes
+ * @return where it ends, or NULL if it can't be answered here
+ */
+static const char *lib_filter(const struct library *lib, const char *s, struct filter **out) {
+  struct filter *f = calloc(sizeof(struct filter), 1);
+  *out = f;
+  s = lib_space(s);
+  if (*s++ != '(') {
+    return NULL;
+  }
+  s = lib_space(s);
+  if (*s == '!') {
+    f->op = F_NOT;
+    if (!(s = lib_filter(lib, s + 1, &f->a))) {
+      return NULL;
+    }
+  } else if (*s == '(') {
+    // One expression, or several joined by AND
+    if (!(s = lib_filter(lib, s, &f->a))) {
+      return NULL;
+    }
+    s = lib_space(s);
+    while (!strncmp(s, "AND ", 4)) {
+      if (f->b) {
+        struct filter *g = calloc(sizeof(struct filter), 1);
+        g->a = f->a;
+        g->b = f->b;
+        f->a = g;
+        f->b = NULL;
+      }
+      if (!(s = lib_filter(lib, s + 4, &f->b))) {
+        return NULL;
+      }
+      s = lib_space(s);
+    }
+  } else {
+    char name[32];
+    size_t len = strcspn(s, " ");
+    if (len >= sizeof(name)) {
+      return NULL;
+    }
+    memcpy(name, s, len);
+    name[len] = 0;
+    if (!strcasecmp(name, "any")) {
+      f->key = -1;
+    } else if ((f->key = lib_key(lib, name)) < 0 || !lib->keytag[f->key]) {
+      return NULL;
+    }
+    // The same keys MPD falls back to for sorting
+    f->fallback[0] = f->fallback[1] = f->fallback[2] = -1;
+    for (size_t i=0;f->key >= 0 && i<NSORTS;i++) {
+      for (int k=1;!strcasecmp(sorts[i].name, name) && k<4 && sorts[i].keys[k];k++) {
+        f->fallback[k - 1] = lib_key(lib, sorts[i].keys[k]);
+      }
+    }
+    s = lib_space(s + len);
+    if (!strncmp(s, "== ", 3)) {
+      f->op = F_EQ;
+    } else if (!strncmp(s, "!= ", 3)) {
+      f->op = F_EQ;
+      f->not = 1;
+    } else if (!strncmp(s, "contains ", 9)) {
+      f->op = F_CONTAINS;
+    } else if (!strncmp(s, "starts_with ", 12)) {
+      f->op = F_STARTS;
+    } else {
+      return NULL;
+    }
+    s = lib_space(strchr(s, ' '));
+    char quote = *s++;
+    if (quote != '"' && quote != '\'') {
+      return NULL;
+    }
+    char *v = f->value = malloc(strlen(s) + 1);
+    while (*s && *s != quote) {
+      if (*s == '\\' && s[1]) {
+        s++;
+      }
+      char ch = *s++;
+      if (ch & 0x80) {
+        // MPD folds the case of more than ASCII
+        return NULL;
+      }
+      *v++ = ch >= 'A' && ch <= 'Z' ? ch + 32 : ch;
+    }
+    *v = 0;
+    if (*s++ != quote) {
+      return NULL;
+    }
+  }
+  s = lib_space(s);
+  if (*s++ != ')') {
+    return NULL;
+  }
+  return s;
+}
+
+/**
+ * Compare a value with a filter's, ignoring the case of ASCII letters
+ */
+static int lib_compare(const struct filter *f, const char *s) {
+  const char *v = f->value;
+  if (f->op == F_CONTAINS && *v) {
+    // Jump to each place the first character is, in either case
+    char first[3] = { *v, *v >= 'a' && *v <= 'z' ? *v - 32 : 0, 0 };
+    for (;(s = strpbrk(s, first));s++) {
+      size_t i;
+      for (i=0;v[i] && lib_lower(s[i]) == v[i];i++) {
+      }
+      if (!v[i]) {
+        return 1;
+      }
+    }
+    return 0;
+  } else if (f->op == F_CONTAINS) {
+    return 1;
+  }
+  for (;*v && lib_lower(*s) == *v;s++, v++) {
+  }
+  return !*v && (f->op == F_STARTS || !*s);
+}
+
+/**
+ * Match a song against a comparison as MPD does: true if any value of the
+ * key is. A song without the key is matched by an empty value, or else is
+ * compared by the first key it falls back to that the song has
+ * @param values set for each string the comparison, before any "!=", is true of
+ */
+static int lib_match_song(const struct library *lib, const struct filter *f, const uint8_t *values, uint32_t t) {
+  uint32_t end = lib_end(lib, t);
+  int found = 0;
+  for (uint32_t i=lib->track[t];i<end;i++) {
+    if (f->key < 0 ? lib->keytag[lib->pairkey[i]] : lib->pairkey[i] == f->key) {
+      found = 1;
+      if (values[lib->pairval[i]] != f->not) {
+        return 1;
+      }
+    }
+  }
+  if (found || f->key < 0) {
+    return 0;
+  } else if (!*f->value) {
+    return 1;
+  }
+  for (int k=0;k<3 && !found;k++) {
+    for (uint32_t i=lib->track[t];f->fallback[k] >= 0 && i<end;i++) {
+      if (lib->pairkey[i] == f->fallback[k]) {
+        found = 1;
+        if (values[lib->pairval[i]] != f->not) {
+          return 1;
+        }
+      }
+    }
+  }
+  return 0;
+}
+
+/**
+ * Find the songs that match a filter
+ * @param match set to 1 for each song that does, 0 if not
+ */
+static void lib_match(const struct library *lib, const struct filter *f, uint8_t *match) {
+  if (f->op == F_AND) {
+    lib_match(lib, f->a, match);
+    if (f->b) {
+      uint8_t *other = malloc(lib->ntracks);
+      lib_match(lib, f->b, other);
+      for (uint32_t t=0;t<lib->ntracks;t++) {
+        match[t] &= other[t];
+      }
+      free(other);
+    }
+    return;
+  } else if (f->op == F_NOT) {
+    lib_match(lib, f->a, match);
+    for (uint32_t t=0;t<lib->ntracks;t++) {
+      match[t] = !match[t];
+    }
+    return;
+  }
+  // Compare each distinct value once rather than once per song, and only
+  // those with all the trigrams of the filter's value when it has some
+  uint32_t *ids = NULL, nids = 0, postings = 0;
+  uint8_t *values = calloc(lib->nstr, 1);
+  size_t vlen = strlen(f->value);
+  if (vlen >= 3) {
+    uint32_t best = 0, bestlen = UINT32_MAX;
+    for (size_t i=0;i + 3<=vlen;i++) {
+      uint32_t tri = lib_trigram(f->value + i);
+      if (lib->trifirst[tri + 1] - lib->trifirst[tri] < bestlen) {
+        best = tri;
+        bestlen = lib->trifirst[tri + 1] - lib->trifirst[tri];
+      }
+    }
+    // Every value that matches is on the list of each of its trigrams, so
+    // only the shortest needs comparing
+    ids = malloc((bestlen ? bestlen : 1) * sizeof(uint32_t));
+    for (uint32_t j=lib->trifirst[best];j<lib->trifirst[best + 1];j++) {
+      uint32_t id = lib->triids[j];
+      if (lib_compare(f, lib->text + lib->str[id])) {
+        ids[nids++] = id;
+      }
+    }
+  } else if (vlen == 2) {
+    // Those with it followed by any character or the end of the string
+    ids = malloc((lib->nstr ? lib->nstr : 1) * sizeof(uint32_t));
+    for (int ch=0;ch<256;ch++) {
+      char tri[3] = { f->value[0], f->value[1], ch };
+      uint32_t t = lib_trigram(tri);
+      for (uint32_t j=lib->trifirst[t];!(ch >= 'A' && ch <= 'Z') && j<lib->trifirst[t + 1];j++) {
+        uint32_t id = lib->triids[j];
+        if (!values[id]) {
+          values[id] = 1;
+          if (lib_compare(f, lib->text + lib->str[id])) {
+            ids[nids++] = id;
+          }
+        }
+      }
+    }
+    memset(values, 0, lib->nstr);
+  } else {
+    ids = malloc((lib->nstr ? lib->nstr : 1) * sizeof(uint32_t));
+    for (uint32_t id=0;id<lib->nstr;id++) {
+      if (lib->strtag[id] && (f->op == F_CONTAINS && !*f->value ? 1 : lib_compare(f, lib->text + lib->str[id]))) {
+        ids[nids++] = id;
+      }
+    }
+  }
+  for (uint32_t j=0;j<nids;j++) {
+    values[ids[j]] = 1;
+    postings += lib->valfirst[ids[j] + 1] - lib->valfirst[ids[j]];
+  }
+  if (!f->not && *f->value && (f->key < 0 ? postings < lib->npairs / 2 : postings < lib->ntracks / 4)) {
+    // Few enough to visit just the songs with the matching values, which
+    // for a particular tag means looking through each one's pairs. Any
+    // song that matches has one, as the tag or one it falls back to
+    memset(match, 0, lib->ntracks);
+    for (uint32_t j=0;j<nids;j++) {
+      for (uint32_t k=lib->valfirst[ids[j]];k<lib->valfirst[ids[j] + 1];k++) {
+        uint32_t t = lib->valtracks[k];
+        match[t] = match[t] || f->key < 0 || lib_match_song(lib, f, values, t);
+      }
+    }
+  } else {
+    for (uint32_t t=0;t<lib->ntracks;t++) {
+      match[t] = lib_match_song(lib, f, values, t);
+    }
+  }
+  free(values);
+  free(ids);
+}
+
+/**
+ * ASCII in the order of the root collation MPD sorts with, through ICU:
+ * whitespace, punctuation and symbols, digits, then letters ignoring case
+ */
+static const char lib_collation[] = "\t\n\v\f\r _-,;:!?.'\"()[]{}@*/\\&#%`^+<=>|~$0123456789abcdefghijklmnopqrstuvwxyz";
+
+/**
+ * U+00C0 to U+017F: the ASCII letter each is with accents added, which the
+ * root collation sorts with until only the accents are left to compare, or
+ * '.' if it's a letter of its own or not a letter
+ */
+static const char lib_latin[] = "AAAAAA.CEEEEIIII.NOOOOO..UUUUY..aaaaaa.ceeeeiiii.nooooo..uuuuy.yAaAaAaCcCcCcCcDd..EeEeEeEeEeGgGgGgGgHh..IiIiIiIiI...JjKk.LlLlLl....NnNnNn...OoOoOo..RrRrRrSsSsSsSsTtTt..UuUuUuUuUuUuWwYyYZzZzZz.";
+// ... and where its accents come among the others on the same letter, from '1'
+static const char lib_accent[] = "214765.521462145.321475..21461..214765.521462145.321475..21461.39933881122443311..99337788552211334411..669933887...1111.113322....114422...883366..113322112244332211..88::3355779911223113322.";
+
+struct lib_rank {
+  const struct library *lib;
+  int numeric;
+  uint8_t weight[256];          // Position in lib_collation + 1, or 0 if not known here
+  int unsure;                   // Compared strings whose order only ICU knows
+};
+
+static const char *lib_str(const struct library *lib, uint32_t id) {
+  return id == NONE ? "" : lib->text + lib->str[id];
+}
+
+/**
+ * Read the next character of a string being collated
+ * @return its weight, or 0 if its order isn't known here
+ */
+static int lib_weight(const struct lib_rank *r, const unsigned char **p) {
+  const unsigned char *s = *p;
+  if (*s >= 0xc3 && *s <= 0xc5 && (s[1] & 0xc0) == 0x80) {
+    char c = lib_latin[(((*s & 0x1f) << 6) | (s[1] & 0x3f)) - 0xc0];
+    *p += 2;
+    return c == '.' ? 0 : r->weight[(unsigned char) c];
+  }
+  (*p)++;
+  return r->weight[*s];
+}
+
+/**
+ * Read the next character of a string being collated, known to be in
+ * lib_collation or lib_latin
+ * @return where its accents come, 0 for none
+ */
+static int lib_accents(const unsigned char **p, int *upper) {
+  const unsigned char *s = *p;
+  if (*s & 0x80) {
+    int i = (((*s & 0x1f) << 6) | (s[1] & 0x3f)) - 0xc0;
+    *p += 2;
+    *upper = lib_latin[i] <= 'Z';
+    return lib_accent[i] - '0';
+  }
+  (*p)++;
+  *upper = *s >= 'A' && *s <= 'Z';
+  return 0;
+}
+
+/**
+ * Compare two strings as the root collation does: by the weight of each
+ * character ignoring case and accents, then by the first difference in
+ * accents, then lower case before upper at the first difference. Control
+ * characters, which it ignores, and anything not in lib_collation or
+ * lib_latin set r->unsure if they're reached before the order is known
+ */
+static int lib_collate(struct lib_rank *r, const char *s, const char *t) {
+  const unsigned char *a = (const unsigned char *) s, *b = (const unsigned char *) t;
+  while (*a && *b) {
+    int x = lib_weight(r, &a), y = lib_weight(r, &b);
+    if (!x || !y) {
+      r->unsure = 1;
+      return strcmp(s, t);
+    } else if (x != y) {
+      return x < y ? -1 : 1;
+    }
+  }
+  if (*a || *b) {
+    // The shorter first, unless the rest is ignored
+    for (const unsigned char *c=*a ? a : b;*c;) {
+      r->unsure |= !lib_weight(r, &c);
+    }
+    return *a ? 1 : -1;
+  }
+  // The same letters one for one. Accents anywhere come before case
+  int tertiary = 0;
+  for (a=(const unsigned char *) s, b=(const unsigned char *) t;*a;) {
+    int u, v, x = lib_accents(&a, &u), y = lib_accents(&b, &v);
+    if (x != y) {
+      return x < y ? -1 : 1;
+    } else if (u != v && !tertiary) {
+      tertiary = u ? 1 : -1;
+    }
+  }
+  return tertiary;
+}
+
+static int lib_rankcmp(const void *a, const void *b, void *arg) {
+  struct lib_rank *r = (struct lib_rank *) arg;
+  const char *s = lib_str(r->lib, *(const uint32_t *) a), *t = lib_str(r->lib, *(const uint32_t *) b);
+  if (r->numeric == 2) {
+    double x = strtod(s, NULL), y = strtod(t, NULL);
+    return x < y ? -1 : x > y;
+  } else if (r->numeric) {
+    long x = strtol(s, NULL, 10), y = strtol(t, NULL, 10);
+    return x < y ? -1 : x > y;
+  }
+  return lib_collate(r, s, t);
+}
+
+/**
+ * @return the songs in the order of a sort, made the first time it's asked
+ * for, or NULL if it would need ICU to know the order MPD uses
+ */
+static const uint32_t *lib_perm(struct library *lib, int sort, int desc) {
+  uint32_t **pp = &lib->perms[sort * 2 + desc];
+  if (*pp) {
+    return *pp == lib_unsorted ? NULL : *pp;
+  }
+  int keys[4];
+  for (int i=0;i<4;i++) {
+    keys[i] = sorts[sort].keys[i] ? lib_key(lib, sorts[sort].keys[i]) : -1;
+  }
+  // The value each song sorts by
+  uint32_t *value = malloc(lib->ntracks * sizeof(uint32_t));
+  for (uint32_t t=0;t<lib->ntracks;t++) {
+    uint32_t end = lib_end(lib, t);
+    value[t] = NONE;
+    for (int k=0;k<4 && value[t] == NONE;k++) {
+      for (uint32_t i=lib->track[t];keys[k] >= 0 && i<end;i++) {
+        if (lib->pairkey[i] == keys[k]) {
+          value[t] = lib->pairval[i];
+          break;
+        }
+      }
+    }
+  }
+  // Rank the distinct values, equal ones the same, then place the songs by
+  // rank in database order
+  uint32_t *rank = calloc(lib->nstr + 1, sizeof(uint32_t));
+  uint32_t *distinct = malloc((lib->nstr + 1) * sizeof(uint32_t));
+  uint32_t ndistinct = 0;
+  for (uint32_t t=0;t<lib->ntracks;t++) {
+    uint32_t id = value[t] == NONE ? lib->nstr : value[t];
+    if (!rank[id]) {
+      rank[id] = 1;
+      distinct[ndistinct++] = value[t];
+    }
+  }
+  struct lib_rank r = { lib, sorts[sort].numeric };
+  for (int i=0;lib_collation[i];i++) {
+    r.weight[(unsigned char) lib_collation[i]] = i + 1;
+    if (lib_collation[i] >= 'a' && lib_collation[i] <= 'z') {
+      r.weight[(unsigned char) lib_collation[i] - 32] = i + 1;
+    }
+  }
+  qsort_r(distinct, ndistinct, sizeof(uint32_t), lib_rankcmp, &r);
+  if (r.unsure) {
+    free(distinct);
+    free(rank);
+    free(value);
+    *pp = lib_unsorted;
+    return NULL;
+  }
+  uint32_t nranks = 0;
+  for (uint32_t i=0;i<ndistinct;i++) {
+    if (!i || lib_rankcmp(&distinct[i - 1], &distinct[i], &r)) {
+      nranks++;
+    }
+    rank[distinct[i] == NONE ? lib->nstr : distinct[i]] = nranks - 1;
+  }
+  if (desc) {
+    // Highest first, but songs that sort the same stay in database order
+    for (uint32_t i=0;i<ndistinct;i++) {
+      uint32_t id = distinct[i] == NONE ? lib->nstr : distinct[i];
+      rank[id] = nranks - 1 - rank[id];
+    }
+  }
+  uint32_t *start = calloc(nranks + 1, sizeof(uint32_t));
+  for (uint32_t t=0;t<lib->ntracks;t++) {
+    start[rank[value[t] == NONE ? lib->nstr : value[t]] + 1]++;
+  }
+  for (uint32_t i=0;i<nranks;i++) {
+    start[i + 1] += start[i];
+  }
+  uint32_t *perm = malloc(lib->ntracks * sizeof(uint32_t));
+  for (uint32_t t=0;t<lib->ntracks;t++) {
+    perm[start[rank[value[t] == NONE ? lib->nstr : value[t]]]++] = t;
+  }
+  free(start);
+  free(distinct);
+  free(rank);
+  free(value);
+  return *pp = perm;
+}
+
+static void lib_out(struct library *lib, library_out out, void *arg, const char *key, const char *value) {
+  size_t klen = strlen(key), vlen = strlen(value);
+  if (klen + vlen + 2 > lib->linesize) {
+    lib->linesize = klen + vlen + 2;
+    lib->line = realloc(lib->line, lib->linesize);
+  }
+  memcpy(lib->line, key, klen);
+  memcpy(lib->line + klen, ": ", 2);
+  memcpy(lib->line + klen + 2, value, vlen);
+  out(arg, lib->line, klen + vlen + 2);
+}
+
+/**
+ * Answer a "search" or "searchcount" command, if it only uses what's here
+ * @return false if it can't be answered here, and nothing's been sent
+ */
+int library_query(struct library *lib, const char *cmd, size_t len, library_out out, void *arg) {
+  char *s = strndup(cmd, len), *argv[MAXARGS];
+  int argc = lib_args(s, argv, MAXARGS);
+  int count = argc >= 2 && !strcmp(argv[0], "searchcount");
+  int sort = -1, desc = 0, ok = argc >= 2 && (count || !strcmp(argv[0], "search"));
+  unsigned long from = 0, to = ULONG_MAX;
+  for (int i=2;ok && i<argc;i+=2) {
+    if (count || i + 1 == argc) {
+      ok = 0;
+    } else if (!strcmp(argv[i], "sort")) {
+      const char *name = argv[i + 1];
+      desc = *name == '-';
+      name += desc;
+      for (sort=0;sort<(int) NSORTS && strcasecmp(sorts[sort].name, name);sort++) {
+      }
+      ok = sort < (int) NSORTS;
+    } else if (!strcmp(argv[i], "window")) {
+      char *end;
+      from = strtoul(argv[i + 1], &end, 10);
+      if (*end == ':' && end[1]) {
+        to = strtoul(end + 1, &end, 10);
+      } else if (*end == ':') {
+        end++;
+      }
+      ok = !*end && from <= to;
+    } else {
+      ok = 0;
+    }
+  }
+  struct filter *f = NULL;
+  const char *rest = ok ? lib_filter(lib, argv[1], &f) : NULL;
+  const uint32_t *perm = rest && sort >= 0 ? lib_perm(lib, sort, desc) : NULL;
+  if (!rest || *lib_space(rest) || (sort >= 0 && !perm)) {
+    lib_filter_free(f);
+    free(s);
+    return 0;
+  }
+  // The filter and sort, to know if it's the same search as last time
+  char *query = malloc(strlen(argv[1]) + 16);
+  sprintf(query, "%s\n%d", argv[1], sort < 0 ? -1 : sort * 2 + desc);
+  if (count || !lib->lastquery || strcmp(lib->lastquery, query)) {
+    uint8_t *match = malloc(lib->ntracks);
+    lib_match(lib, f, match);
+    if (count) {
+      unsigned long long playtime = 0;
+      uint32_t songs = 0;
+      for (uint32_t t=0;t<lib->ntracks;t++) {
+        if (match[t]) {
+          songs++;
+          playtime += lib->duration[t];
+        }
+      }
+      char buf[64];
+      out(arg, buf, snprintf(buf, sizeof(buf), "songs: %u", songs));
+      out(arg, buf, snprintf(buf, sizeof(buf), "playtime: %llu", playtime / 1000));
+      out(arg, "OK", 2);
+      free(match);
+      free(query);
+      lib_filter_free(f);
+      free(s);
+      return 1;
+    }
+    lib->result = realloc(lib->result, lib->ntracks * sizeof(uint32_t));
+    lib->nresult = 0;
+    for (uint32_t i=0;i<lib->ntracks;i++) {
+      uint32_t t = perm ? perm[i] : i;
+      if (match[t]) {
+        lib->result[lib->nresult++] = t;
+      }
+    }
+    free(match);
+    free(lib->lastquery);
+    lib->lastquery = query;
+  } else {
+    free(query);
+  }
+  for (unsigned long i=from;i<to && i<lib->nresult;i++) {
+    uint32_t t = lib->result[i], end = lib_end(lib, t);
+    for (uint32_t j=lib->track[t];j<end;j++) {
+      lib_out(lib, out, arg, lib->keys[lib->pairkey[j]], lib_str(lib, lib->pairval[j]));
+    }
+  }
+  out(arg, "OK", 2);
+  lib_filter_free(f);
+  free(s);
+  return 1;
+}
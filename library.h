@@ -0,0 +1,30 @@
+#ifndef LIBRARY
+#define LIBRARY
+
+#include <stddef.h>
+
+/**
+ * An in-memory copy of the songs in an MPD database, loaded from the
+ * output of "listallinfo", which can answer "search" and "searchcount"
+ */
+struct library;
+
+/**
+ * Called with each line of a response, without the newline
+ */
+typedef void (*library_out)(void *arg, const char *line, size_t len);
+
+struct library *library_new(void);
+void library_line(struct library *lib, const char *line, size_t len);
+void library_done(struct library *lib);
+int library_save(struct library *lib, const char *path, unsigned long long stamp);
+struct library *library_open(const char *path, unsigned long long stamp);
+int library_copy(struct library *dst, struct library *src, const char *file, size_t len);
+struct library *library_merge(struct library *order, struct library *changed);
+size_t library_modified(struct library *lib, char *buf, size_t len);
+int library_query(struct library *lib, const char *cmd, size_t len, library_out out, void *arg);
+size_t library_tracks(const struct library *lib);
+size_t library_bytes(const struct library *lib);
+void library_free(struct library *lib);
+
+#endif
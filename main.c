@@ -1,11 +1,17 @@
 #define _GNU_SOURCE
 #include <sys/socket.h>
-#include <poll.h>
+#include <netinet/tcp.h>
 #include <stdio.h>
+#include <limits.h>
+#include <pthread.h>
 #include "mongoose.h"
+#include "library.h"
 #if SERVESTATIC
 #include "embeddedfile.h"
 #endif
+#ifdef ZLIB
+#include <zlib.h>
+#endif
 #ifdef AVAHI
 #include <avahi-client/client.h>
 #include <avahi-client/lookup.h>
@@ -14,253 +20,2815 @@
 #include <avahi-common/error.h>
 #endif
 
-//#define DEBUG 1
-
-#define MAXLINE 512     // Max possible length of single line from MPD
-#define TIMEOUT 50      // Seconds between ping
+//#define DEBUG 1
+
+#define MAXLINE (1024*1024)     // Default for --max-line
+#define LINEBLOCK 4096  // Size of the pooled buffers for lines split across reads
+#define LINEPOOL 64     // Most free line buffers to keep in each worker's pool
+#define TIMEOUT 50      // Seconds between ping
+#define CONNECTTIMEOUT 3000     // Milliseconds to wait for a connection to MPD
+#define MAXOUT 65536    // Largest outbound buffer to MPD kept between writes
+#define FORMAT_LINES 0  // One websocket frame per line from MPD
+#define FORMAT_BATCH 1  // One websocket frame per response
+#define FORMAT_JSON 2   // One websocket frame per response, as JSON records
+#define MAXKEYS 64      // Most distinct keys in one FORMAT_JSON frame
+#define READSIZE 32768  // Read buffer for each MPD connection
+#define READBUDGET (256*1024)   // Most to read from one MPD connection per poll
+#define BATCHLIMIT 65536        // Default size to split a response at with "proxy-format batch"
+#define HIGHWATER (256*1024)    // Stop reading from MPD when this much is waiting for the client
+#define LOWWATER (64*1024)      // ... and start again when it's drained to this
+#define POOLSIZE 4      // Default for --pool
+#define CACHESIZE (32*1024*1024)        // Default for --cache
+#define TOOBIG 64       // Commands remembered as having responses too big to cache
+#define FLIGHTS 256     // Buckets in each worker's index of commands being shared
+#define WATCHRETRY 5    // Seconds before a watcher reconnects to MPD
+#define WATCH_GREETING 0        // Watcher states: waiting for "OK MPD"
+#define WATCH_PARTITION 1       // ... waiting for the answer to "partition"
+#define WATCH_IDLE 2            // ... in "idle"
+#define WATCH_LOADING 3         // ... for the answer to "listallinfo"
+#define WATCH_STATS 4           // ... for the answer to "stats", before loading
+#define WATCH_CHANGED 5         // ... for the songs modified since the last load
+#define WATCH_LISTALL 6         // ... for the answer to "listall"
+#define WATCH_MISSING 7         // ... for the songs "listall" found that weren't loaded
+#define WATCH_INDEXING 8        // ... while the library's indexed and saved on another thread
+#define WATCHMISSING 1000       // Most songs to fetch one at a time, before loading them all instead
+
+static char *bindaddr = "0.0.0.0";
+static int port = 8000;
+static char *rootdir = NULL;
+static int threads = 1;
+static size_t maxline = MAXLINE;
+static int poolsize = POOLSIZE;
+static size_t cachesize = CACHESIZE;
+static int uselibrary = 1;
+static char *librarydir = NULL;         // Where to keep snapshots of the library, if anywhere
+#ifdef ZLIB
+static int deflatelevel = 6;            // 0 to not offer permessage-deflate
+static int deflatewindow = 15;
+static int deflatereset = 0;            // Start each message with an empty window
+#endif
+
+struct myhost {
+  char name[100];
+  char host[100];
+  int port;
+  struct myhost *next;
+};
+
+/**
+ * The state of a FORMAT_JSON response. Values for the record being built
+ * are kept until it's complete, then compared against the previous record
+ */
+struct json {
+  char *recordkey;              // The first key of the response, which starts each record
+  int entity;                   // recordkey is file, directory or playlist, any of which start a record
+  int nkeys, nrecords, pending; // Keys and records in this frame, and if a record is being built
+  char *keys[MAXKEYS];
+  struct mg_iobuf cur[MAXKEYS], prev[MAXKEYS];  // Values of each key, nul terminated
+  int ncur[MAXKEYS], nprev[MAXKEYS];
+};
+
+/**
+ * An idle connection to MPD in a worker's pool, waiting to be lent to a client
+ */
+struct pooled {
+  struct worker *worker;
+  struct mg_connection *c;
+  struct myhost host;
+  char hello[64];               // MPD's greeting, the reply to proxy-connect
+  time_t idle;                  // When it was returned or last pinged
+  int pinged;
+  struct pooled *next;
+};
+
+/**
+ * A connection to MPD that stays in idle for one partition, telling every
+ * client subscribed with proxy-subscribe what's changed
+ */
+struct watcher {
+  struct worker *worker;
+  struct myhost host;
+  char partition[64];
+  struct mg_connection *c;      // NULL if not connected
+  struct resolve *resolve;      // Pending name lookup, or NULL
+  int state;                    // WATCH_GREETING, WATCH_PARTITION, WATCH_IDLE or loading the library
+  time_t retry;                 // When to connect again after losing the connection
+  int subscribers;
+  int reload;                   // Load the library before going idle again
+  struct library *library;      // The server's songs, if this watcher keeps them
+  struct library *loading;      // ... and the next copy, while it's loading
+  struct library *previous;     // The copy from before the database changed, while syncing
+  struct library *changed;      // ... and the songs in it that have changed
+  struct mg_iobuf missing;      // Commands to fetch the songs that weren't in either
+  int nmissing;
+  struct indexing *indexing;    // Indexing the library that's loaded, or NULL
+  unsigned long long dbupdate;  // "db_update" from "stats" before loading it
+  struct watcher *next;
+};
+
+/**
+ * A response from MPD to a read-only command, kept until the database changes
+ */
+struct cached {
+  struct myhost host;
+  char *cmd;
+  uint32_t hash;
+  char *data;                   // The response, each line ending in a newline
+  size_t len, end;              // Its length, and where the final OK is
+  size_t *records, nrecords;    // Where each record starts, to send a window of them
+  struct cached *prev, *next;   // Linkage in the worker's cache, most recently used first
+};
+
+struct mycon {
+  struct worker *worker;
+  struct mg_connection *mgcon;
+  struct mg_connection *mpd;    // Connection to MPD, or NULL if not connected
+  struct myhost host;           // The server from the last proxy-connect
+  struct resolve *resolve;      // Pending name lookup, or NULL
+  char *out;                    // Commands for MPD, written once per read from the websocket
+  size_t outlen, outsize;
+  int connecting;
+  uint64_t deadline;            // When to give up connecting
+  int greeting, quiet;          // Waiting for MPD's greeting, and not passing it on
+  char hello[64];               // MPD's greeting on this connection
+  int borrow;                   // Connected with a pool, so each command borrows a connection
+  int pinned;                   // Sent a command that changes the connection's state, so keep it
+  int pending, inlist;          // Responses still to come from MPD, and if in a command list
+  int idling;                   // ... one of them to "idle", so it could be a long time coming
+  int booting;                  // Answering proxy-bootstrap, which starts with the greeting
+  char *bootlib;                // ... and its searches, to answer from the library after MPD's part
+  struct watcher *watcher;      // Set by proxy-subscribe
+  struct mg_iobuf events;       // Changes held back during a binary frame, one per line
+  char *capture;                // The command whose response is being cached, or NULL
+  unsigned capturegen;          // The worker's cachegen when it was sent
+  struct mg_iobuf captured;     // The response so far
+  int window;                   // Only sending some of the records captured
+  long windowfrom, windowto, windowrec; // ... which ones, and which record we're in
+  char windowkey[32];           // The key that starts each record
+  size_t windowkeylen;
+  int nocache;                  // Sent a command that changes what responses look like
+  char *flight;                 // The command whose response other clients are sharing, or NULL
+  uint32_t flighthash;          // ... its hash, and the next in the same bucket of the worker's index
+  struct mycon *flightnext;
+  int flightshut;               // ... out of the index, as its response has started and nobody else can join
+  struct mycon *followers;      // ... the clients sharing it
+  struct mycon *leader;         // The client whose response to the same command this one's sharing
+  struct mycon *followprev, *follownext;        // Linkage in the leader's followers
+  char *waiting;                // ... the command, to send if that client goes away
+  struct mg_iobuf held;         // Commands received meanwhile, each ending in a nul
+  int resuming;                 // Sending the commands that were held
+  unsigned long requests, responses;    // Responses owed to the client and sent, counting from the start
+  struct mg_iobuf tags;         // Tags from proxy-tag: the number of the response, then the tag ending in a nul
+  int tagsent;                  // Sent the tag of the response being sent
+  char *buf;                    // A line split across reads, or NULL
+  size_t off, bufsize;
+  int drop, skip;               // Dropping a line over maxline, and the rest of its response
+  size_t binlen;                // Binary payload still to come, plus the newline after it
+  int format;                   // FORMAT_LINES, FORMAT_BATCH or FORMAT_JSON, set by proxy-format
+  size_t batchlimit;
+  struct mg_iobuf batch;        // The response so far for FORMAT_BATCH, one line per newline
+  struct json *json;            // Created on first use of FORMAT_JSON
+#ifdef ZLIB
+  int deflate;                  // permessage-deflate negotiated
+  int deflatebits, deflatereset;        // Our window size and context takeover, as negotiated
+  z_stream *zout, *zin;         // Created on first use
+#endif
+  int pinged;                   // Sent "ping" to keep the connection open, and the OK hasn't come yet
+  time_t ping;
+  size_t sendmax;               // Most ever queued for the client
+  unsigned stalls;              // Times MPD reads were paused for the client
+  uint64_t stalled, stalltime;  // When the current pause started, and total milliseconds paused
+  struct mycon *prev, *next;            // Linkage in worker root list
+  struct mycon *pingprev, *pingnext;    // Linkage in pinghead list
+  struct mycon *outprev, *outnext;      // Linkage in outhead list
+};
+
+/**
+ * Each worker thread has its own event loop, listener and connections.
+ * Nothing here is shared between threads
+ */
+struct worker {
+  pthread_t thread;
+  struct mg_mgr mgr;
+  int pipe;                     // Helper threads write completed lookups and indexing here
+  pthread_mutex_t pipelock;     // ... one at a time, so their handoffs don't interleave
+  // Lookups on their way, newest first
+  struct resolve *resolving;
+  struct mycon *root;
+  // Connections to MPD, least recently active first. The event loop only ever
+  // has to look at the head of this list to find connections that need a ping
+  struct mycon *pinghead, *pingtail;
+  // Connections with commands queued for MPD, written after each poll
+  struct mycon *outhead;
+  // Idle connections to MPD, ready to be lent out
+  struct pooled *pool;
+  // Connections in idle for proxy-subscribe, one per server and partition
+  struct watcher *watchers;
+  // Responses to read-only commands, most recently used first
+  struct cached *cachehead, *cachetail;
+  size_t cachelen;
+  unsigned cachegen;            // Changed whenever the cache is invalidated
+  uint32_t toobig[TOOBIG];      // Hashes of commands whose responses were too big, the oldest replaced first
+  unsigned ntoobig;
+  unsigned long coalesced;      // Commands answered by sharing another client's response
+  unsigned long libanswered, libpassed; // Searches answered from a library, and left to MPD though there was one
+  // Clients with a response other clients could share, by the command's hash
+  struct mycon *flights[FLIGHTS];
+  // Free LINEBLOCK buffers, linked through their first bytes
+  char *linepool;
+  int linepooled;
+};
+
+/**
+ * A name lookup, run on its own thread so getaddrinfo() can't block the event loop
+ */
+struct resolve {
+  struct worker *worker;
+  struct mycon *mycon;          // The connection that asked, or NULL if it's gone away
+  struct watcher *watcher;      // ... or the watcher that asked
+  char host[100];
+  int port;
+  char url[INET6_ADDRSTRLEN + 20];      // The resolved address, or empty on failure
+  const char *error;
+  struct resolve *next;         // Linkage in the worker's lookups on their way
+};
+
+/**
+ * A library that's finished loading, indexed and saved on its own thread so
+ * the event loop carries on meanwhile. The thread owns the libraries until
+ * it's handed back
+ */
+struct indexing {
+  struct worker *worker;
+  struct watcher *watcher;      // The watcher that loaded it, or NULL if it's gone away
+  struct library *library;
+  struct library *changed;      // Songs to take in place of those in library first, or NULL
+  char path[PATH_MAX];          // Where to save it, or empty
+  unsigned long long stamp;
+  int error;                    // errno if it couldn't be saved
+};
+
+/**
+ * What helper threads send through a worker's pipe: one or the other
+ */
+struct handoff {
+  struct resolve *resolve;
+  struct indexing *indexing;
+};
+
+// The host list is shared by all workers, and only written by Avahi
+struct myhost *hostroot = NULL;
+static pthread_rwlock_t hostlock = PTHREAD_RWLOCK_INITIALIZER;
+// Held while a library is saved, so workers indexing the same songs at once map one file
+static pthread_mutex_t savelock = PTHREAD_MUTEX_INITIALIZER;
+#ifdef AVAHI
+static AvahiSimplePoll *avahipoll = NULL;
+#endif
+
+static void mpdfn(struct mg_connection *c, int ev, void *ev_data, void *fn_data);
+int mpd_disconnect(struct mycon *mycon);
+int mpd_send(struct mycon *mycon, char *buf, int len);
+int mpd_command(struct mycon *mycon, char *buf, int len);
+int command_is(const char *buf, size_t len, const char **verbs);
+void flight_shut(struct mycon *mycon);
+void flight_end(struct mycon *mycon, int abort);
+void held_resume(struct mycon *mycon);
+static void tag_line(struct mycon *mycon, const char *line, size_t len, int batched);
+void watch_resolved(struct watcher *wt, struct resolve *r);
+void watch_indexed(struct indexing *x);
+void ws_line(struct mycon *mycon, const char *line, size_t len);
+void mpd_flush(struct mycon *mycon);
+void mpd_queue(struct mycon *mycon, const char *buf, size_t len);
+void mpd_checkdrained(struct mycon *mycon);
+void line_free(struct mycon *mycon);
+void batch_flush(struct mycon *mycon);
+
+/**
+ * Start a websocket frame of len bytes. The payload is added with mg_send()
+ * as it arrives, so it's never held in full
+ */
+void ws_begin(struct mg_connection *c, size_t len, int op) {
+  unsigned char h[10];
+  size_t n = 2;
+  h[0] = (unsigned char) (op | 128);
+  if (len < 126) {
+    h[1] = (unsigned char) len;
+  } else if (len < 65536) {
+    h[1] = 126;
+    h[2] = (unsigned char) (len >> 8);
+    h[3] = (unsigned char) len;
+    n = 4;
+  } else {
+    h[1] = 127;
+    for (int i=0;i<8;i++) {
+      h[2 + i] = (unsigned char) ((uint64_t) len >> (56 - 8 * i));
+    }
+    n = 10;
+  }
+  mg_send(c, h, n);
+}
+
+/**
+ * Send a text message to the client, compressed if permessage-deflate was negotiated
+ */
+void ws_send(struct mycon *mycon, const char *buf, size_t len) {
+  struct mg_connection *c = mycon->mgcon;
+#ifdef ZLIB
+  if (mycon->deflate) {
+    z_stream *z = mycon->zout;
+    if (!z) {
+      z = mycon->zout = calloc(sizeof(z_stream), 1);
+      if (deflateInit2(z, deflatelevel, Z_DEFLATED, -mycon->deflatebits, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        fprintf(stderr, "deflateInit2 failed\n");
+        exit(1);
+      }
+    }
+    // Compress straight into the send buffer, then put the header in front
+    size_t start = c->send.len, used = 0;
+    z->next_in = (Bytef *) buf;
+    z->avail_in = (uInt) len;
+    do {
+      size_t room = deflateBound(z, z->avail_in) + 16;
+      mg_iobuf_add(&c->send, start + used, NULL, room);
+      z->next_out = c->send.buf + start + used;
+      z->avail_out = (uInt) room;
+      deflate(z, Z_SYNC_FLUSH);
+      used += room - z->avail_out;
+      c->send.len = start + used;
+    } while (z->avail_out == 0);
+    // Without the 00 00 ff ff that ends every flush (RFC 7692 7.2.1)
+    c->send.len -= 4;
+    mg_ws_wrap(c, used - 4, WEBSOCKET_OP_TEXT | 0x40);
+    if (mycon->deflatereset) {
+      deflateReset(z);
+    }
+    return;
+  }
+#endif
+  mg_ws_send(c, buf, len, WEBSOCKET_OP_TEXT);
+}
+
+#ifdef ZLIB
+/**
+ * Decompress a message from the client. Returns a malloc'd copy with a nul
+ * after it, or NULL if it's not valid or would be longer than maxline
+ */
+char *ws_inflate(struct mycon *mycon, const char *in, size_t *len) {
+  static unsigned char tail[4] = { 0, 0, 0xff, 0xff };
+  z_stream *z = mycon->zin;
+  if (!z) {
+    z = mycon->zin = calloc(sizeof(z_stream), 1);
+    if (inflateInit2(z, -15) != Z_OK) {
+      fprintf(stderr, "inflateInit2 failed\n");
+      exit(1);
+    }
+  }
+  size_t size = *len * 4 + 64;
+  char *out = malloc(size);
+  z->next_out = (Bytef *) out;
+  int r = Z_OK;
+  // The message, then the 00 00 ff ff the client removed from the end
+  for (int i=0;i<2 && r == Z_OK;i++) {
+    z->next_in = i ? tail : (Bytef *) in;
+    z->avail_in = i ? sizeof(tail) : (uInt) *len;
+    do {
+      size_t used = (char *) z->next_out - out;
+      if (size - used < 64) {
+        size *= 2;
+        out = realloc(out, size);
+      }
+      z->next_out = (Bytef *) out + used;
+      z->avail_out = (uInt) (size - used - 1);
+      r = inflate(z, Z_SYNC_FLUSH);
+    } while (r == Z_OK && (z->avail_in || !z->avail_out) && (size_t) ((char *) z->next_out - out) <= maxline);
+    if (r == Z_BUF_ERROR) {
+      r = Z_OK;         // Nothing more to do
+    }
+  }
+  *len = (char *) z->next_out - out;
+  if (r == Z_STREAM_END) {
+    inflateReset(z);    // The client ended the stream, which it's allowed to
+  } else if (r != Z_OK || *len > maxline) {
+    free(out);
+    return NULL;
+  }
+  out[*len] = 0;
+  return out;
+}
+
+/**
+ * Choose the first permessage-deflate offer (RFC 7692) we can accept from the
+ * client's Sec-WebSocket-Extensions header. Returns the value for our header,
+ * or NULL to decline them all
+ */
+char *ws_negotiate(struct mg_http_message *hm, char *resp, size_t size, int *bits, int *reset) {
+  struct mg_str *h = mg_http_get_header(hm, "Sec-WebSocket-Extensions");
+  if (!h || !deflatelevel) {
+    return NULL;
+  }
+  char offers[512];
+  snprintf(offers, sizeof(offers), "%.*s", (int) h->len, h->ptr);
+  char *save1, *save2;
+  for (char *offer = strtok_r(offers, ",", &save1);offer;offer = strtok_r(NULL, ",", &save1)) {
+    char *name = strtok_r(offer, "; \t", &save2);
+    if (!name || strcmp(name, "permessage-deflate")) {
+      continue;
+    }
+    int ok = 1, b = deflatewindow, r = deflatereset, askedbits = 0;
+    for (char *param = strtok_r(NULL, "; \t", &save2);param && ok;param = strtok_r(NULL, "; \t", &save2)) {
+      if (!strcmp(param, "server_no_context_takeover")) {
+        r = 1;
+      } else if (!strncmp(param, "server_max_window_bits=", 23)) {
+        // zlib can't do the 8 that RFC 7692 allows
+        int n = atoi(param + 23);
+        ok = n >= 9 && n <= 15;
+        b = n < b ? n : b;
+        askedbits = 1;
+      } else if (strcmp(param, "client_no_context_takeover") && strcmp(param, "client_max_window_bits") && strncmp(param, "client_max_window_bits=", 23)) {
+        ok = 0;
+      }
+    }
+    if (ok) {
+      snprintf(resp, size, "permessage-deflate%s", r ? "; server_no_context_takeover" : "");
+      if (askedbits) {
+        snprintf(resp + strlen(resp), size - strlen(resp), "; server_max_window_bits=%d", b);
+      }
+      *bits = b;
+      *reset = r;
+      return resp;
+    }
+  }
+  return NULL;
+}
+#endif
+
+/**
+ * printf a line of a response to the client, as a text message of its own
+ */
+void ws_printf(struct mycon *mycon, const char *fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  char *buf = mg_vmprintf(fmt, &ap);
+  va_end(ap);
+  tag_line(mycon, buf, strlen(buf), 0);
+  ws_send(mycon, buf, strlen(buf));
+  free(buf);
+}
+
+/**
+ * Tell the client something's changed. Not part of any response, so can be
+ * sent between the lines of one
+ */
+void ws_changed(struct mycon *mycon, const char *name, size_t len) {
+  char *buf = mg_mprintf("proxy-changed: %.*s", (int) len, name);
+  ws_send(mycon, buf, strlen(buf));
+  free(buf);
+}
+
+/**
+ * Return true if the line is the last of a response
+ */
+static int line_isend(const char *line, size_t len) {
+  return (len == 2 && !memcmp(line, "OK", 2)) || (len > 4 && !memcmp(line, "ACK ", 4)) || (len > 7 && !memcmp(line, "OK MPD ", 7));
+}
+
+/**
+ * Find the command in a frame sent as "proxy-tag tag command"
+ * @param len the length of the frame, set to the length of the command
+ * @return the command, or the whole frame if it isn't tagged
+ */
+static char *tag_command(char *buf, size_t *len, char **tag, size_t *taglen) {
+  char *sp = *len > 10 && !strncmp(buf, "proxy-tag ", 10) ? memchr(buf + 10, ' ', *len - 10) : NULL;
+  if (!sp || sp == buf + 10) {
+    *tag = NULL;
+    *taglen = 0;
+    return buf;
+  }
+  *tag = buf + 10;
+  *taglen = sp - *tag;
+  *len -= sp + 1 - buf;
+  return sp + 1;
+}
+
+/**
+ * Forget the tags of responses that have been sent, or won't be
+ */
+static void tag_drop(struct mycon *mycon) {
+  struct mg_iobuf *io = &mycon->tags;
+  unsigned long n;
+  while (io->len && (memcpy(&n, io->buf, sizeof(n)), n < mycon->responses)) {
+    mg_iobuf_del(io, 0, sizeof(n) + strlen((char *) io->buf + sizeof(n)) + 1);
+  }
+}
+
+/**
+ * Called with each line of a response before it's sent to the client. If
+ * the command was sent with proxy-tag, the response starts with a
+ * "proxy-tag: tag" line, so the client knows which one it is
+ * @param batched true if the line is going in a FORMAT_BATCH frame, which the tag goes in too
+ */
+static void tag_line(struct mycon *mycon, const char *line, size_t len, int batched) {
+  struct mg_iobuf *io = &mycon->tags;
+  unsigned long n;
+  if (io->len && !mycon->tagsent && (memcpy(&n, io->buf, sizeof(n)), n == mycon->responses)) {
+    const char *tag = (char *) io->buf + sizeof(n);
+    mycon->tagsent = 1;
+    if (batched) {
+      mg_iobuf_add(&mycon->batch, mycon->batch.len, "proxy-tag: ", 11);
+      mg_iobuf_add(&mycon->batch, mycon->batch.len, tag, strlen(tag));
+      mg_iobuf_add(&mycon->batch, mycon->batch.len, "\n", 1);
+    } else {
+      char *buf = mg_mprintf("proxy-tag: %s", tag);
+      ws_send(mycon, buf, strlen(buf));
+      free(buf);
+    }
+  }
+  if (line_isend(line, len)) {
+    mycon->responses++;
+    mycon->tagsent = 0;
+    tag_drop(mycon);
+  }
+}
+
+/**
+ * Count the responses MPD sends to commands: one for each command, or for
+ * each command list
+ * @param inlist true if in a command list, updated for the commands
+ */
+static unsigned long command_responses(const char *buf, size_t len, int *inlist) {
+  const char *end = buf + len;
+  unsigned long count = 0;
+  while (buf < end) {
+    const char *eol = memchr(buf, '\n', end - buf);
+    if (!eol) {
+      eol = end;
+    }
+    size_t n = 0;
+    while (buf + n < eol && buf[n] != ' ') {
+      n++;
+    }
+    if (!n) {
+      // MPD ignores empty lines
+    } else if (!*inlist && ((n == 18 && !memcmp(buf, "command_list_begin", 18)) || (n == 21 && !memcmp(buf, "command_list_ok_begin", 21)))) {
+      *inlist = 1;
+    } else if (*inlist && n == 16 && !memcmp(buf, "command_list_end", 16)) {
+      *inlist = 0;
+      count++;
+    } else if (!*inlist) {
+      count++;
+    }
+    buf = eol + 1;
+  }
+  return count;
+}
+
+/**
+ * Record activity on the MPD connection, moving it to the tail of the ping list.
+ * If it's no longer connected to MPD, remove it from the list
+ */
+void mpd_touch(struct mycon *mycon) {
+  struct worker *w = mycon->worker;
+  if (mycon->pingprev) {
+    mycon->pingprev->pingnext = mycon->pingnext;
+  } else if (w->pinghead == mycon) {
+    w->pinghead = mycon->pingnext;
+  }
+  if (mycon->pingnext) {
+    mycon->pingnext->pingprev = mycon->pingprev;
+  } else if (w->pingtail == mycon) {
+    w->pingtail = mycon->pingprev;
+  }
+  mycon->pingprev = mycon->pingnext = NULL;
+  if (mycon->mpd) {
+    mycon->ping = time(NULL);
+    mycon->pingprev = w->pingtail;
+    if (w->pingtail) {
+      w->pingtail->pingnext = mycon;
+    } else {
+      w->pinghead = mycon;
+    }
+    w->pingtail = mycon;
+  }
+}
+
+/**
+ * Pass a helper thread's result back to the worker's event loop. The pipe is
+ * a stream, so this waits rather than dropping it if the loop is behind
+ */
+static void handoff_send(struct worker *w, const struct handoff *h) {
+  const char *p = (const char *) h;
+  size_t left = sizeof(*h);
+  pthread_mutex_lock(&w->pipelock);
+  while (left) {
+    ssize_t n = send(w->pipe, p, left, MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    } else if (n < 0) {
+      perror("send");
+      break;
+    }
+    p += n;
+    left -= (size_t) n;
+  }
+  pthread_mutex_unlock(&w->pipelock);
+}
+
+static void *resolve_run(void *arg) {
+  struct resolve *r = (struct resolve *) arg;
+  struct worker *w = r->worker;
+  struct addrinfo hints = { .ai_socktype = SOCK_STREAM }, *addrinfo, *addr = NULL;
+  int e = getaddrinfo(r->host, NULL, &hints, &addrinfo);
+  if (e) {
+    r->error = gai_strerror(e);
+  } else {
+    // Prefer IPv4, as MPD doesn't always listen on IPv6
+    for (struct addrinfo *a=addrinfo;a;a=a->ai_next) {
+      if (a->ai_family == AF_INET || (a->ai_family == AF_INET6 && !addr)) {
+        addr = a;
+      }
+    }
+    char address[INET6_ADDRSTRLEN];
+    if (addr && addr->ai_family == AF_INET && inet_ntop(AF_INET, &((struct sockaddr_in *) addr->ai_addr)->sin_addr, address, sizeof(address))) {
+      snprintf(r->url, sizeof(r->url), "tcp://%s:%d", address, r->port);
+    } else if (addr && addr->ai_family == AF_INET6 && inet_ntop(AF_INET6, &((struct sockaddr_in6 *) addr->ai_addr)->sin6_addr, address, sizeof(address))) {
+      snprintf(r->url, sizeof(r->url), "tcp://[%s]:%d", address, r->port);
+    } else {
+      r->error = "no address";
+    }
+    freeaddrinfo(addrinfo);
+  }
+  // Hand the result back to the worker's event loop
+  struct handoff h = { r, NULL };
+  handoff_send(w, &h);
+  return NULL;
+}
+
+/**
+ * Start looking up a host on another thread. The result is passed back
+ * through the worker's pipe to resolvefn()
+ * @return the lookup, or NULL with errno set if it couldn't be started
+ */
+struct resolve *resolve_start(struct worker *w, const struct myhost *host) {
+  struct resolve *r = calloc(sizeof(struct resolve), 1);
+  r->worker = w;
+  strncpy(r->host, host->host, sizeof(r->host) - 1);
+  r->port = host->port;
+  pthread_t thread;
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  int e = pthread_create(&thread, &attr, resolve_run, r);
+  pthread_attr_destroy(&attr);
+  if (e) {
+    errno = e;
+    free(r);
+    return NULL;
+  }
+  r->next = w->resolving;
+  w->resolving = r;
+  return r;
+}
+
+/**
+ * Start connecting to MPD. This returns immediately: the name is looked up on
+ * another thread, then mongoose connects. The client is told the outcome by
+ * MPD's "OK MPD" greeting or by an ACK from mpd_connect_failed()
+ */
+int mpd_connect(struct mycon *mycon, const struct myhost *host) {
+  struct resolve *r = resolve_start(mycon->worker, host);
+  if (!r) {
+    return 1;
+  }
+  r->mycon = mycon;
+  mycon->host = *host;
+  mycon->resolve = r;
+  mycon->connecting = 1;
+  mycon->greeting = 1;
+  // Covers the lookup as well, which resolve_poll() times out
+  mycon->deadline = mg_millis() + CONNECTTIMEOUT;
+  return 0;
+}
+
+void mpd_connect_failed(struct mycon *mycon, const char *error) {
+  struct myhost *h = &mycon->host;
+  // Commands sent after proxy-connect, or that a connection was made to
+  // borrow for, are waiting too and all need an answer
+  int n = mycon->pending + !mycon->quiet;
+  for (int i=0;i<n || !i;i++) {
+    ws_printf(mycon, "ACK [0@0] {%s} connection to name \"%s\" host \"%s\" port %d failed: %s", mycon->booting ? "proxy-bootstrap" : "proxy-connect", h->name, h->host, h->port, error);
+  }
+  mycon->connecting = mycon->pending = 0;
+  mpd_disconnect(mycon);
+  held_resume(mycon);
+}
+
+/**
+ * Called on the worker thread when a lookup completes
+ */
+void mpd_resolved(struct mycon *mycon, struct resolve *r) {
+  mycon->resolve = NULL;
+  if (!*r->url) {
+    mpd_connect_failed(mycon, r->error);
+    return;
+  }
+  mycon->mpd = mg_connect(&mycon->worker->mgr, r->url, mpdfn, mycon);
+  // Anything queued while resolving is handed to mongoose to send on connect
+  mpd_flush(mycon);
+}
+
+/**
+ * Return the hash of a command to a server, FNV-1a
+ */
+static uint32_t cache_hash(const struct myhost *host, const char *cmd, size_t len) {
+  uint32_t h = 2166136261u ^ (uint32_t) host->port;
+  for (const char *s=host->host;*s;s++) {
+    h = (h ^ (unsigned char) *s) * 16777619u;
+  }
+  for (size_t i=0;i<len;i++) {
+    h = (h ^ (unsigned char) cmd[i]) * 16777619u;
+  }
+  return h;
+}
+
+static void cache_remove(struct worker *w, struct cached *e) {
+  if (e->prev) {
+    e->prev->next = e->next;
+  } else {
+    w->cachehead = e->next;
+  }
+  if (e->next) {
+    e->next->prev = e->prev;
+  } else {
+    w->cachetail = e->prev;
+  }
+  w->cachelen -= e->len + e->nrecords * sizeof(size_t);
+  free(e->cmd);
+  free(e->data);
+  free(e->records);
+  free(e);
+}
+
+/**
+ * Drop everything cached from a server, and anything on its way to the cache
+ */
+void cache_invalidate(struct worker *w, const struct myhost *host) {
+  for (struct cached *e=w->cachehead, *next;e;e=next) {
+    next = e->next;
+    if (e->host.port == host->port && !strcmp(e->host.host, host->host)) {
+      cache_remove(w, e);
+    }
+  }
+  w->cachegen++;
+  w->ntoobig = 0;
+}
+
+/**
+ * Return true if the response to a command was too big to cache last time
+ */
+int cache_toobig(struct mycon *mycon, const char *buf, size_t len) {
+  struct worker *w = mycon->worker;
+  uint32_t hash = cache_hash(&mycon->host, buf, len);
+  for (unsigned i=0;i<w->ntoobig && i<TOOBIG;i++) {
+    if (w->toobig[i] == hash) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static void library_sent(void *arg, const char *line, size_t len) {
+  ws_line((struct mycon *) arg, line, len);
+}
+
+/**
+ * Find the library of the client's server, if there's one up to date
+ */
+struct library *library_find(struct mycon *mycon) {
+  for (struct watcher *wt=mycon->worker->watchers;wt;wt=wt->next) {
+    if (wt->library && wt->state == WATCH_IDLE && wt->c && wt->host.port == mycon->host.port && !strcmp(wt->host.host, mycon->host.host)) {
+      return wt->library;
+    }
+  }
+  return NULL;
+}
+
+/**
+ * Answer a search from the library of the client's server, if there's one
+ * up to date and the search only uses what it has
+ * @return true if it's been answered
+ */
+int library_reply(struct mycon *mycon, const char *buf, size_t len) {
+  if (mycon->nocache || mycon->inlist || memchr(buf, '\n', len)) {
+    return 0;
+  }
+  static const char *verbs[] = { "search", "searchcount", NULL };
+  struct library *lib = library_find(mycon);
+  if (!lib) {
+    return 0;
+  } else if (library_query(lib, buf, len, library_sent, mycon)) {
+    mycon->worker->libanswered++;
+    return 1;
+  } else if (command_is(buf, len, verbs)) {
+    mycon->worker->libpassed++;
+  }
+  return 0;
+}
+
+/**
+ * Return true if the command is one of a list
+ */
+int command_is(const char *buf, size_t len, const char **verbs) {
+  size_t n = 0;
+  while (n < len && buf[n] != ' ') {
+    n++;
+  }
+  int i = 0;
+  while (verbs[i] && (n != strlen(verbs[i]) || memcmp(buf, verbs[i], n))) {
+    i++;
+  }
+  return verbs[i] != NULL;
+}
+
+/**
+ * Return true if a command's response can be cached: a read-only query of
+ * the database, while a watcher will tell us when the database changes
+ */
+int cache_allowed(struct mycon *mycon, const char *buf, size_t len) {
+  static const char *verbs[] = { "search", "searchcount", "find", "count", "list", "listplaylistinfo", NULL };
+  if (!cachesize || mycon->nocache || mycon->inlist || memchr(buf, '\n', len) || !command_is(buf, len, verbs)) {
+    return 0;
+  }
+  for (struct watcher *wt=mycon->worker->watchers;wt;wt=wt->next) {
+    if (wt->state == WATCH_IDLE && wt->c && wt->host.port == mycon->host.port && !strcmp(wt->host.host, mycon->host.host)) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/**
+ * Find the window in "search ... window a:b" or "find ... window a:b". The
+ * rest of the command asks for every record, which once cached can answer
+ * any window of the same search
+ * @return the length of the command without the window, or 0 if there isn't one
+ */
+size_t cache_window(const char *buf, size_t len, long *from, long *to) {
+  if (strncmp(buf, "search ", 7) && strncmp(buf, "find ", 5)) {
+    return 0;
+  }
+  size_t i = len;
+  while (i > 0 && buf[i - 1] != ' ') {
+    i--;
+  }
+  if (i < 8 || memcmp(buf + i - 8, " window ", 8)) {
+    return 0;
+  }
+  const char *p = buf + i, *end = buf + len;
+  *from = *to = 0;
+  while (p < end && *p >= '0' && *p <= '9') {
+    *from = *from * 10 + *p++ - '0';
+  }
+  if (p == buf + i || p == end || *p++ != ':' || p == end) {
+    return 0;
+  }
+  while (p < end && *p >= '0' && *p <= '9') {
+    *to = *to * 10 + *p++ - '0';
+  }
+  return p == end && *to > *from && *to < 1000000000 ? i - 8 : 0;
+}
+
+/**
+ * Answer a command from the cache, if it's there
+ * @param from the first record to send, or -1 for the whole response
+ * @param to the record after the last to send
+ * @return true if it was
+ */
+int cache_reply(struct mycon *mycon, const char *buf, size_t len, long from, long to) {
+  struct worker *w = mycon->worker;
+  uint32_t hash = cache_hash(&mycon->host, buf, len);
+  for (struct cached *e=w->cachehead;e;e=e->next) {
+    if (e->hash == hash && !strncmp(e->cmd, buf, len) && !e->cmd[len] && e->host.port == mycon->host.port && !strcmp(e->host.host, mycon->host.host)) {
+      if (e != w->cachehead) {
+        // Most recently used to the front
+        e->prev->next = e->next;
+        if (e->next) {
+          e->next->prev = e->prev;
+        } else {
+          w->cachetail = e->prev;
+        }
+        e->prev = NULL;
+        e->next = w->cachehead;
+        w->cachehead->prev = e;
+        w->cachehead = e;
+      }
+      char *start = e->data, *stop = e->data + e->len;
+      if (from >= 0) {
+        start = e->data + ((size_t) from < e->nrecords ? e->records[from] : e->end);
+        stop = e->data + ((size_t) to < e->nrecords ? e->records[to] : e->end);
+      }
+      for (char *p=start, *eol;p<stop;p=eol + 1) {
+        eol = memchr(p, '\n', stop - p);
+        ws_line(mycon, p, eol - p);
+      }
+      if (from >= 0) {
+        ws_line(mycon, e->data + e->end, 2);
+      }
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/**
+ * Start collecting the response to a command for the cache
+ */
+void cache_capture(struct mycon *mycon, const char *buf, size_t len) {
+  free(mycon->capture);
+  mycon->capture = strndup(buf, len);
+  mycon->capturegen = mycon->worker->cachegen;
+  mycon->captured.len = 0;
+}
+
+/**
+ * Stop collecting a response, keeping it if complete and nothing's changed
+ * since the command was sent. The least recently used entries make room
+ */
+void cache_captured(struct mycon *mycon, int ok) {
+  struct worker *w = mycon->worker;
+  struct mg_iobuf *io = &mycon->captured;
+  if (ok && mycon->capturegen == w->cachegen && io->len <= cachesize / 2) {
+    struct cached *e = calloc(sizeof(struct cached), 1);
+    e->host = mycon->host;
+    e->cmd = mycon->capture;
+    e->hash = cache_hash(&e->host, e->cmd, strlen(e->cmd));
+    e->data = malloc(io->len);
+    memcpy(e->data, io->buf, io->len);
+    e->len = io->len;
+    e->end = io->len - 3;
+    // Records start with the first key of the response
+    const char *first = NULL;
+    size_t firstlen = 0, nalloc = 0;
+    for (size_t off=0;off<e->end;) {
+      const char *line = e->data + off;
+      const char *eol = memchr(line, '\n', e->len - off);
+      const char *sep = memmem(line, eol - line, ": ", 2);
+      if (sep && !first) {
+        first = line;
+        firstlen = sep - line;
+      }
+      if (sep && (size_t) (sep - line) == firstlen && !memcmp(line, first, firstlen)) {
+        if (e->nrecords == nalloc) {
+          nalloc = nalloc ? nalloc * 2 : 64;
+          e->records = realloc(e->records, nalloc * sizeof(size_t));
+        }
+        e->records[e->nrecords++] = off;
+      }
+      off = eol - e->data + 1;
+    }
+    e->next = w->cachehead;
+    if (w->cachehead) {
+      w->cachehead->prev = e;
+    } else {
+      w->cachetail = e;
+    }
+    w->cachehead = e;
+    w->cachelen += e->len + e->nrecords * sizeof(size_t);
+    while (w->cachelen > cachesize) {
+      cache_remove(w, w->cachetail);
+    }
+    mycon->capture = NULL;
+  }
+  free(mycon->capture);
+  mycon->capture = NULL;
+  if (io->size > LINEBLOCK) {
+    mg_iobuf_free(io);
+  }
+  io->len = 0;
+}
+
+/**
+ * Send a client a line of a response, only the records inside its window
+ * if it asked for one
+ */
+void cache_send(struct mycon *mycon, const char *line, size_t len, int end) {
+  int send = 1;
+  if (mycon->window && !end) {
+    const char *sep = memmem(line, len, ": ", 2);
+    size_t klen = sep ? (size_t) (sep - line) : 0;
+    if (sep && !mycon->windowkeylen && klen < sizeof(mycon->windowkey)) {
+      memcpy(mycon->windowkey, line, klen);
+      mycon->windowkeylen = klen;
+    }
+    if (sep && klen == mycon->windowkeylen && !memcmp(line, mycon->windowkey, klen)) {
+      mycon->windowrec++;
+    }
+    send = mycon->windowrec > mycon->windowfrom && mycon->windowrec <= mycon->windowto;
+  }
+  if (end) {
+    mycon->window = 0;
+  }
+  if (send) {
+    ws_line(mycon, line, len);
+  }
+}
+
+/**
+ * Pass on a line of a response that's being cached or shared, to the client
+ * and any others sharing it
+ */
+void cache_line(struct mycon *mycon, const char *line, size_t len) {
+  int end = line_isend(line, len);
+  if (mycon->flight && !mycon->flightshut) {
+    // Anyone joining now would only get the rest of it
+    flight_shut(mycon);
+  }
+  if (mycon->capture) {
+    mg_iobuf_add(&mycon->captured, mycon->captured.len, line, len);
+    mg_iobuf_add(&mycon->captured, mycon->captured.len, "\n", 1);
+    if (mycon->captured.len > cachesize / 2) {
+      // Too big to keep, but the window can still be sent. Next time only
+      // the window is asked for
+      struct worker *w = mycon->worker;
+      w->toobig[w->ntoobig++ % TOOBIG] = cache_hash(&mycon->host, mycon->capture, strlen(mycon->capture));
+      cache_captured(mycon, 0);
+    } else if (end) {
+      cache_captured(mycon, len == 2);
+    }
+  }
+  cache_send(mycon, line, len, end);
+  for (struct mycon *f=mycon->followers;f;f=f->follownext) {
+    cache_send(f, line, len, end);
+  }
+  if (end && mycon->flight) {
+    flight_end(mycon, 0);
+  }
+}
+
+/**
+ * Return true if a command's response can be shared with other clients that
+ * send the same one while it's on its way: a read-only command whose
+ * response doesn't depend on the partition or the connection
+ */
+int flight_allowed(struct mycon *mycon, const char *buf, size_t len) {
+  static const char *verbs[] = { "stats", "listpartitions", "listplaylists", "search", "searchcount", "find", "count", "list", "listplaylistinfo", NULL };
+  return !mycon->nocache && !mycon->inlist && !memchr(buf, '\n', len) && command_is(buf, len, verbs);
+}
+
+/**
+ * Find a client waiting for the response to the same command from the same server
+ */
+struct mycon *flight_find(struct mycon *mycon, const char *buf, size_t len) {
+  uint32_t hash = cache_hash(&mycon->host, buf, len);
+  for (struct mycon *m=mycon->worker->flights[hash % FLIGHTS];m;m=m->flightnext) {
+    if (m != mycon && m->flighthash == hash && !strncmp(m->flight, buf, len) && !m->flight[len] && m->host.port == mycon->host.port && !strcmp(m->host.host, mycon->host.host)) {
+      return m;
+    }
+  }
+  return NULL;
+}
+
+/**
+ * Start waiting for the response to a command, which other clients can share
+ */
+void flight_start(struct mycon *mycon, const char *buf, size_t len) {
+  struct mycon **bucket;
+  mycon->flight = strndup(buf, len);
+  mycon->flighthash = cache_hash(&mycon->host, buf, len);
+  mycon->flightshut = 0;
+  bucket = &mycon->worker->flights[mycon->flighthash % FLIGHTS];
+  mycon->flightnext = *bucket;
+  *bucket = mycon;
+}
+
+/**
+ * Share the response another client is waiting for
+ */
+void flight_follow(struct mycon *mycon, struct mycon *leader) {
+  mycon->leader = leader;
+  mycon->followprev = NULL;
+  mycon->follownext = leader->followers;
+  if (leader->followers) {
+    leader->followers->followprev = mycon;
+  }
+  leader->followers = mycon;
+}
+
+/**
+ * Stop sharing another client's response
+ */
+void flight_unfollow(struct mycon *mycon) {
+  if (mycon->followprev) {
+    mycon->followprev->follownext = mycon->follownext;
+  } else {
+    mycon->leader->followers = mycon->follownext;
+  }
+  if (mycon->follownext) {
+    mycon->follownext->followprev = mycon->followprev;
+  }
+  mycon->followprev = mycon->follownext = NULL;
+  mycon->leader = NULL;
+}
+
+/**
+ * Send on the commands a client received while sharing another's response
+ * @param resend true if the response never came, so the client has to send
+ * the command itself
+ */
+void flight_resume(struct mycon *mycon, int resend) {
+  char *cmd = mycon->waiting;
+  flight_unfollow(mycon);
+  mycon->waiting = NULL;
+  if (resend && cmd) {
+    mycon->window = 0;
+    mpd_command(mycon, cmd, strlen(cmd));
+  }
+  free(cmd);
+  held_resume(mycon);
+}
+
+/**
+ * Take a client's command out of the worker's index, so no more clients can
+ * share its response
+ */
+void flight_shut(struct mycon *mycon) {
+  for (struct mycon **pp=&mycon->worker->flights[mycon->flighthash % FLIGHTS];*pp;pp=&(*pp)->flightnext) {
+    if (*pp == mycon) {
+      *pp = mycon->flightnext;
+      break;
+    }
+  }
+  mycon->flightnext = NULL;
+  mycon->flightshut = 1;
+}
+
+/**
+ * Stop sharing a client's response with others
+ * @param abort true if it won't arrive, so the others have to ask for it themselves
+ */
+void flight_end(struct mycon *mycon, int abort) {
+  if (!mycon->flightshut) {
+    flight_shut(mycon);
+  }
+  free(mycon->flight);
+  mycon->flight = NULL;
+  // Each leaves the list as it's resumed, and nobody else can join it now
+  while (mycon->followers) {
+    flight_resume(mycon->followers, abort);
+  }
+}
+
+/**
+ * Tell every client subscribed to the watcher that something's changed. Not
+ * while a binary frame is being sent, which can't be interrupted: those
+ * are sent by events_flush() once it's done
+ */
+void watch_event(struct watcher *wt, const char *name, size_t len) {
+  for (struct mycon *mycon=wt->worker->root;mycon;mycon=mycon->next) {
+    if (mycon->watcher != wt) {
+      // Not subscribed
+    } else if (mycon->binlen) {
+      struct mg_iobuf *io = &mycon->events;
+      // Once is enough
+      int found = 0;
+      for (size_t i=0;i<io->len && !found;i+=strlen((char *) io->buf + i) + 1) {
+        found = strlen((char *) io->buf + i) == len && !memcmp(io->buf + i, name, len);
+      }
+      if (!found) {
+        mg_iobuf_add(io, io->len, name, len);
+        mg_iobuf_add(io, io->len, "", 1);
+      }
+    } else {
+      ws_changed(mycon, name, len);
+    }
+  }
+}
+
+/**
+ * Send the changes held back by watch_event()
+ */
+void events_flush(struct mycon *mycon) {
+  struct mg_iobuf *io = &mycon->events;
+  for (size_t i=0;i<io->len;i+=strlen((char *) io->buf + i) + 1) {
+    ws_changed(mycon, (char *) io->buf + i, strlen((char *) io->buf + i));
+  }
+  io->len = 0;
+}
+
+/**
+ * Find the snapshot of the library of a watcher's server
+ * @return path, or NULL if there's nowhere to keep it
+ */
+char *library_path(struct watcher *wt, char *path, size_t len) {
+  if (!librarydir || snprintf(path, len, "%s/%s_%d.library", librarydir, wt->host.host, wt->host.port) >= (int) len) {
+    return NULL;
+  }
+  return path;
+}
+
+/**
+ * Start loading the library of a watcher's server: only what's changed if
+ * there's a copy from before the database changed
+ */
+void watch_load(struct watcher *wt) {
+  char stamp[64];
+  library_free(wt->changed);
+  library_free(wt->loading);
+  wt->changed = wt->loading = NULL;
+  wt->missing.len = wt->nmissing = 0;
+  if (wt->previous && library_modified(wt->previous, stamp, sizeof(stamp))) {
+    // The songs modified since the latest in the old copy, then every file
+    // to find those removed or added with an older time
+    mg_printf(wt->c, "find \"(modified-since '%s')\"\n", stamp);
+    wt->state = WATCH_CHANGED;
+    wt->changed = library_new();
+  } else {
+    library_free(wt->previous);
+    wt->previous = NULL;
+    mg_printf(wt->c, "listallinfo\n");
+    wt->state = WATCH_LOADING;
+    wt->loading = library_new();
+  }
+}
+
+/**
+ * Merge, index and save a library, on the thread started by watch_loaded()
+ */
+static void index_work(struct indexing *x) {
+  if (x->changed) {
+    struct library *lib = library_merge(x->library, x->changed);
+    library_free(x->library);
+    library_free(x->changed);
+    x->library = lib;
+    x->changed = NULL;
+  }
+  library_done(x->library);
+  if (!*x->path) {
+    return;
+  }
+  // Map the snapshot in, whether another thread loaded the same songs
+  // meanwhile or this one saves it, so every thread shares its pages
+  // instead of keeping a copy each
+  pthread_mutex_lock(&savelock);
+  struct library *lib = library_open(x->path, x->stamp);
+  if (!lib && library_save(x->library, x->path, x->stamp)) {
+    x->error = errno;
+  } else if (lib || (lib = library_open(x->path, x->stamp))) {
+    library_free(x->library);
+    x->library = lib;
+  }
+  pthread_mutex_unlock(&savelock);
+}
+
+static void *index_run(void *arg) {
+  struct indexing *x = (struct indexing *) arg;
+  index_work(x);
+  // Hand the result back to the worker's event loop
+  struct handoff h = { NULL, x };
+  handoff_send(x->worker, &h);
+  return NULL;
+}
+
+/**
+ * Start answering searches from a library that's been indexed, and go back
+ * to waiting for changes. Called on the worker thread
+ */
+void watch_indexed(struct indexing *x) {
+  struct watcher *wt = x->watcher;
+  if (x->error) {
+    fprintf(stderr, "Can't save library to \"%s\": %s\n", x->path, strerror(x->error));
+  }
+  if (!wt) {
+    // Nobody's interested in it now
+    library_free(x->library);
+    return;
+  }
+  library_free(wt->library);
+  wt->library = x->library;
+  wt->indexing = NULL;
+  mg_printf(wt->c, "idle\n");
+  wt->state = WATCH_IDLE;
+}
+
+/**
+ * The library's finished loading, so index it and save it on another thread,
+ * and meanwhile searches go to MPD. The watcher stays out of idle until
+ * it's done, so MPD tells it about any change since
+ * @param merge true to take the songs in wt->changed in place of those loaded
+ */
+void watch_loaded(struct watcher *wt, int merge) {
+  struct indexing *x = calloc(sizeof(struct indexing), 1);
+  x->worker = wt->worker;
+  x->watcher = wt;
+  x->library = wt->loading;
+  x->changed = merge ? wt->changed : NULL;
+  if (!library_path(wt, x->path, sizeof(x->path))) {
+    *x->path = 0;
+  }
+  x->stamp = wt->dbupdate;
+  if (!merge) {
+    library_free(wt->changed);
+  }
+  library_free(wt->previous);
+  wt->previous = wt->changed = wt->loading = NULL;
+  wt->missing.len = wt->nmissing = 0;
+  wt->indexing = x;
+  wt->state = WATCH_INDEXING;
+  pthread_t thread;
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  int e = pthread_create(&thread, &attr, index_run, x);
+  pthread_attr_destroy(&attr);
+  if (e) {
+    // Do it here instead
+    index_work(x);
+    watch_indexed(x);
+    free(x);
+  }
+}
+
+/**
+ * Callback for Mongoose event on a watcher's connection to MPD
+ */
+static void watchfn(struct mg_connection *c, int ev, void *ev_data __attribute__((unused)), void *fn_data) {
+  struct watcher *wt = (struct watcher *) fn_data;
+  if (!wt) {
+    // Nobody's subscribed any more, waiting to be closed
+  } else if (ev == MG_EV_READ) {
+    char *p = (char *) c->recv.buf, *end = p + c->recv.len, *eol;
+    while (!c->is_closing && (eol = memchr(p, '\n', end - p))) {
+      size_t len = eol - p;
+      if (wt->state == WATCH_STATS && !line_isend(p, len)) {
+        if (len > 11 && !memcmp(p, "db_update: ", 11)) {
+          wt->dbupdate = strtoull(p + 11, NULL, 10);
+        }
+      } else if (wt->state == WATCH_STATS) {
+        char path[PATH_MAX];
+        struct library *lib;
+        library_path(wt, path, sizeof(path));
+        if (len == 2 && (lib = library_open(path, wt->dbupdate))) {
+          // Already saved by another thread or before a restart
+          library_free(wt->previous);
+          wt->previous = NULL;
+          wt->library = lib;
+          mg_printf(c, "idle\n");
+          wt->state = WATCH_IDLE;
+        } else if (len == 2) {
+          watch_load(wt);
+        } else {
+          library_free(wt->previous);
+          wt->previous = NULL;
+          mg_printf(c, "idle\n");
+          wt->state = WATCH_IDLE;
+        }
+      } else if (wt->state == WATCH_LOADING && line_isend(p, len)) {
+        if (len == 2) {
+          watch_loaded(wt, 0);
+        } else {
+          library_free(wt->loading);
+          wt->loading = NULL;
+          mg_printf(c, "idle\n");
+          wt->state = WATCH_IDLE;
+        }
+      } else if (wt->state == WATCH_LOADING) {
+        library_line(wt->loading, p, len);
+      } else if ((wt->state == WATCH_CHANGED || wt->state == WATCH_LISTALL || wt->state == WATCH_MISSING) && len != 2 && line_isend(p, len)) {
+        // No "modified-since" before MPD 0.21, or a song went while it was
+        // being fetched. Load everything instead
+        library_free(wt->previous);
+        wt->previous = NULL;
+        watch_load(wt);
+      } else if (wt->state == WATCH_CHANGED && len == 2) {
+        mg_printf(c, "listall\n");
+        wt->state = WATCH_LISTALL;
+        wt->loading = library_new();
+      } else if (wt->state == WATCH_LISTALL && len == 2 && !wt->nmissing) {
+        watch_loaded(wt, 0);
+      } else if (wt->state == WATCH_LISTALL && len == 2 && wt->nmissing > WATCHMISSING) {
+        library_free(wt->previous);
+        wt->previous = NULL;
+        watch_load(wt);
+      } else if (wt->state == WATCH_LISTALL && len == 2) {
+        mg_printf(c, "command_list_begin\n%.*scommand_list_end\n", (int) wt->missing.len, (char *) wt->missing.buf);
+        wt->state = WATCH_MISSING;
+      } else if (wt->state == WATCH_LISTALL && len > 6 && !memcmp(p, "file: ", 6)) {
+        // In the order of the database, from the old copy if it hasn't changed
+        if (!library_copy(wt->loading, wt->changed, p + 6, len - 6) && !library_copy(wt->loading, wt->previous, p + 6, len - 6)) {
+          // Only the file for now, filled in by library_merge()
+          library_line(wt->loading, p, len);
+          mg_iobuf_add(&wt->missing, wt->missing.len, "lsinfo \"", 8);
+          for (char *s=p + 6;s<eol;s++) {
+            if (*s == '"' || *s == '\\') {
+              mg_iobuf_add(&wt->missing, wt->missing.len, "\\", 1);
+            }
+            mg_iobuf_add(&wt->missing, wt->missing.len, s, 1);
+          }
+          mg_iobuf_add(&wt->missing, wt->missing.len, "\"\n", 2);
+          wt->nmissing++;
+        }
+      } else if (wt->state == WATCH_LISTALL) {
+        // A directory
+      } else if (wt->state == WATCH_MISSING && len == 2) {
+        watch_loaded(wt, 1);
+      } else if (wt->state == WATCH_CHANGED || wt->state == WATCH_MISSING) {
+        library_line(wt->changed, p, len);
+      } else if (wt->state == WATCH_IDLE && len > 9 && !memcmp(p, "changed: ", 9)) {
+        if ((len == 17 && !memcmp(p + 9, "database", 8)) || (len == 24 && !memcmp(p + 9, "stored_playlist", 15))) {
+          cache_invalidate(wt->worker, &wt->host);
+        }
+        if (len == 17 && !memcmp(p + 9, "database", 8) && wt->library) {
+          // Out of date, so searches go to MPD until it's synced again
+          library_free(wt->previous);
+          wt->previous = wt->library;
+          wt->library = NULL;
+          wt->reload = 1;
+        }
+        watch_event(wt, p + 9, len - 9);
+      } else if (wt->state == WATCH_GREETING && len > 7 && !memcmp(p, "OK MPD ", 7) && strcmp(wt->partition, "default")) {
+        char tbuf[sizeof(wt->partition) * 2], *t = tbuf;
+        for (char *s=wt->partition;*s;s++) {
+          if (*s == '"' || *s == '\\') {
+            *t++ = '\\';
+          }
+          *t++ = *s;
+        }
+        mg_printf(c, "partition \"%.*s\"\n", (int) (t - tbuf), tbuf);
+        wt->state = WATCH_PARTITION;
+      } else if (((wt->state == WATCH_GREETING && len > 7 && !memcmp(p, "OK MPD ", 7)) || (len == 2 && !memcmp(p, "OK", 2))) && wt->reload) {
+        if (librarydir) {
+          // A snapshot can be used if the database hasn't changed since
+          mg_printf(c, "stats\n");
+          wt->state = WATCH_STATS;
+          wt->dbupdate = 0;
+        } else {
+          watch_load(wt);
+        }
+        wt->reload = 0;
+      } else if ((wt->state == WATCH_GREETING && len > 7 && !memcmp(p, "OK MPD ", 7)) || (len == 2 && !memcmp(p, "OK", 2))) {
+        mg_printf(c, "idle\n");
+        wt->state = WATCH_IDLE;
+      } else {
+        // An ACK, most likely the partition has gone. Try again later
+        c->is_closing = 1;
+      }
+      p = eol + 1;
+    }
+    mg_iobuf_del(&c->recv, 0, p - (char *) c->recv.buf);
+  } else if (ev == MG_EV_CONNECT) {
+    // Big enough for "listallinfo" to arrive in few reads
+    mg_iobuf_resize(&c->recv, READSIZE);
+  } else if (ev == MG_EV_CLOSE) {
+    // Changes could be missed until it's back
+    wt->c = NULL;
+    if (wt->indexing) {
+      wt->indexing->watcher = NULL;
+      wt->indexing = NULL;
+    }
+    wt->retry = time(NULL) + WATCHRETRY;
+    cache_invalidate(wt->worker, &wt->host);
+    library_free(wt->library);
+    library_free(wt->loading);
+    library_free(wt->previous);
+    library_free(wt->changed);
+    wt->library = wt->loading = wt->previous = wt->changed = NULL;
+    wt->missing.len = wt->nmissing = 0;
+  }
+}
+
+/**
+ * Return true if another watcher keeps the library for a watcher's server
+ */
+int library_kept(struct watcher *wt) {
+  for (struct watcher *o=wt->worker->watchers;o;o=o->next) {
+    if (o != wt && o->host.port == wt->host.port && !strcmp(o->host.host, wt->host.host) && (o->library || o->loading || o->previous || o->indexing || o->reload)) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/**
+ * Called on the worker thread when a watcher's lookup completes
+ */
+void watch_resolved(struct watcher *wt, struct resolve *r) {
+  wt->resolve = NULL;
+  if (!*r->url) {
+    wt->retry = time(NULL) + WATCHRETRY;
+    return;
+  }
+  wt->state = WATCH_GREETING;
+  wt->reload = uselibrary && !library_kept(wt);
+  wt->c = mg_connect(&wt->worker->mgr, r->url, watchfn, wt);
+}
+
+/**
+ * Connect any watchers that lost their connection to MPD, once it's time to retry
+ */
+void watch_poll(struct worker *w) {
+  time_t now = time(NULL);
+  for (struct watcher *wt=w->watchers;wt;wt=wt->next) {
+    if (!wt->c && !wt->resolve && now >= wt->retry) {
+      if ((wt->resolve = resolve_start(w, &wt->host))) {
+        wt->resolve->watcher = wt;
+      } else {
+        wt->retry = now + WATCHRETRY;
+      }
+    }
+  }
+}
+
+/**
+ * Stop sending changes to a client, and close the watcher if it was the last one
+ */
+void mpd_unsubscribe(struct mycon *mycon) {
+  struct watcher *wt = mycon->watcher;
+  mycon->watcher = NULL;
+  mycon->events.len = 0;
+  if (wt && !--wt->subscribers) {
+    for (struct watcher **pp=&mycon->worker->watchers;*pp;pp=&(*pp)->next) {
+      if (*pp == wt) {
+        *pp = wt->next;
+        break;
+      }
+    }
+    if (wt->c) {
+      wt->c->fn_data = NULL;
+      wt->c->is_closing = 1;
+      mg_activate(wt->c);
+    }
+    if (wt->resolve) {
+      wt->resolve->watcher = NULL;
+    }
+    if (wt->indexing) {
+      wt->indexing->watcher = NULL;
+    }
+    if (wt->library || wt->loading || wt->previous || wt->indexing || wt->reload) {
+      // Another watcher for the server can keep it instead
+      for (struct watcher *o=mycon->worker->watchers;o;o=o->next) {
+        if (o->host.port == wt->host.port && !strcmp(o->host.host, wt->host.host)) {
+          o->reload = 1;
+          if (o->c && o->state == WATCH_IDLE) {
+            mg_printf(o->c, "noidle\n");
+          }
+          break;
+        }
+      }
+    }
+    library_free(wt->library);
+    library_free(wt->loading);
+    library_free(wt->previous);
+    library_free(wt->changed);
+    mg_iobuf_free(&wt->missing);
+    cache_invalidate(mycon->worker, &wt->host);
+    free(wt);
+  }
+}
+
+/**
+ * Send changes in a partition of the client's server to the client, sharing
+ * a watcher with any other client subscribed to the same one
+ */
+void mpd_subscribe(struct mycon *mycon, const char *partition) {
+  struct worker *w = mycon->worker;
+  struct watcher *wt;
+  mpd_unsubscribe(mycon);
+  for (wt=w->watchers;wt;wt=wt->next) {
+    if (wt->host.port == mycon->host.port && !strcmp(wt->host.host, mycon->host.host) && !strcmp(wt->partition, partition)) {
+      break;
+    }
+  }
+  if (!wt) {
+    // Connected on the next poll
+    wt = calloc(sizeof(struct watcher), 1);
+    wt->worker = w;
+    wt->host = mycon->host;
+    snprintf(wt->partition, sizeof(wt->partition), "%s", partition);
+    wt->next = w->watchers;
+    w->watchers = wt;
+  }
+  wt->subscribers++;
+  mycon->watcher = wt;
+}
+
+/**
+ * Callback for Mongoose event on a worker's resolver pipe
+ */
+static void resolvefn(struct mg_connection *c, int ev, void *ev_data __attribute__((unused)), void *fn_data __attribute__((unused))) {
+  if (ev == MG_EV_READ) {
+    struct handoff h;
+    size_t i;
+    for (i=0;i + sizeof(h)<=c->recv.len;i+=sizeof(h)) {
+      memcpy(&h, c->recv.buf + i, sizeof(h));
+      struct resolve *r = h.resolve;
+      if (r) {
+        struct worker *w = r->worker;
+        for (struct resolve **pp=&w->resolving;*pp;pp=&(*pp)->next) {
+          if (*pp == r) {
+            *pp = r->next;
+            break;
+          }
+        }
+      }
+      if (h.indexing) {
+        watch_indexed(h.indexing);
+        free(h.indexing);
+      } else if (r->mycon) {
+        mpd_resolved(r->mycon, r);
+      } else if (r->watcher) {
+        watch_resolved(r->watcher, r);
+      }
+      free(r);
+    }
+    mg_iobuf_del(&c->recv, 0, i);
+  }
+}
+
+/**
+ * Lend an idle connection from the pool to a client
+ * @return true if there was one for its server
+ */
+int mpd_borrow(struct mycon *mycon) {
+  struct worker *w = mycon->worker;
+  for (struct pooled **pp=&w->pool;*pp;pp=&(*pp)->next) {
+    struct pooled *p = *pp;
+    if (!p->pinged && p->host.port == mycon->host.port && !strcmp(p->host.host, mycon->host.host)) {
+      *pp = p->next;
+      mycon->mpd = p->c;
+      mycon->mpd->fn = mpdfn;
+      mycon->mpd->fn_data = mycon;
+      memcpy(mycon->hello, p->hello, sizeof(mycon->hello));
+      free(p);
+      mpd_touch(mycon);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/**
+ * Callback for Mongoose event on an idle connection in the pool
+ */
+static void poolfn(struct mg_connection *c, int ev, void *ev_data __attribute__((unused)), void *fn_data) {
+  struct pooled *p = (struct pooled *) fn_data;
+  if (ev == MG_EV_READ) {
+    if (p->pinged && c->recv.len < 3 && !memcmp(c->recv.buf, "OK\n", c->recv.len)) {
+      // Rest of the answer to come
+    } else if (p->pinged && c->recv.len == 3 && !memcmp(c->recv.buf, "OK\n", 3)) {
+      p->pinged = 0;
+      c->recv.len = 0;
+    } else {
+      // Nothing else should arrive while idle
+      c->is_closing = 1;
+    }
+  } else if (ev == MG_EV_CLOSE) {
+    struct worker *w = p->worker;
+    for (struct pooled **pp=&w->pool;*pp;pp=&(*pp)->next) {
+      if (*pp == p) {
+        *pp = p->next;
+        break;
+      }
+    }
+    free(p);
+  }
+}
+
+/**
+ * Return a client's connection to the pool once MPD has answered everything
+ * sent on it, or close it if the pool for that server is full
+ */
+void mpd_release(struct mycon *mycon) {
+  struct worker *w = mycon->worker;
+  struct mg_connection *c = mycon->mpd;
+  int n = 0;
+  for (struct pooled *p=w->pool;p;p=p->next) {
+    if (p->host.port == mycon->host.port && !strcmp(p->host.host, mycon->host.host)) {
+      n++;
+    }
+  }
+  mycon->mpd = NULL;
+  if (n < poolsize && !c->is_closing) {
+    struct pooled *p = calloc(sizeof(struct pooled), 1);
+    p->worker = w;
+    p->c = c;
+    p->host = mycon->host;
+    memcpy(p->hello, mycon->hello, sizeof(p->hello));
+    p->idle = time(NULL);
+    p->next = w->pool;
+    w->pool = p;
+    c->fn = poolfn;
+    c->fn_data = p;
+    c->is_full = 0;
+  } else {
+    c->fn_data = NULL;
+    c->is_closing = 1;
+  }
+  mg_activate(c);
+  mpd_checkdrained(mycon);
+  mpd_touch(mycon);
+}
+
+/**
+ * Keep idle connections in the pool alive, and close any that stop answering
+ */
+void pool_poll(struct worker *w) {
+  time_t now = time(NULL);
+  for (struct pooled *p=w->pool;p;p=p->next) {
+    if (now - p->idle > TIMEOUT) {
+      if (p->pinged) {
+        p->c->is_closing = 1;
+        mg_activate(p->c);
+      } else {
+        mg_send(p->c, "ping\n", 5);
+        p->pinged = 1;
+        p->idle = now;
+      }
+    }
+  }
+}
+
+/**
+ * Note the responses MPD owes for commands being sent, and pin the connection
+ * to the client if any of them change its state
+ */
+void mpd_count(struct mycon *mycon, const char *buf, size_t len) {
+  static const char *pins[] = { "partition", "idle", "password", "tagtypes", "binarylimit", "subscribe", "protocol", NULL };
+  const char *end = buf + len;
+  mycon->pending += command_responses(buf, len, &mycon->inlist);
+  while (buf < end) {
+    const char *eol = memchr(buf, '\n', end - buf);
+    if (!eol) {
+      eol = end;
+    }
+    size_t n = 0;
+    while (buf + n < eol && buf[n] != ' ') {
+      n++;
+    }
+    for (int i=0;n && pins[i];i++) {
+      if (n == strlen(pins[i]) && !memcmp(buf, pins[i], n)) {
+        mycon->pinned = 1;
+        // These change what responses look like, or who can see them
+        mycon->nocache |= i == 2 || i == 3 || i == 6;
+        mycon->idling |= i == 1;
+      }
+    }
+    buf = eol + 1;
+  }
+}
+
+int mpd_disconnect(struct mycon *mycon) {
+  if (mycon->resolve) {
+    // Let the lookup finish, but nobody's interested in it now
+    mycon->resolve->mycon = NULL;
+    mycon->resolve = NULL;
+  }
+  if (mycon->mpd && mycon->borrow && !mycon->pinned && !mycon->pending && !mycon->greeting && !mycon->pinged && !mycon->binlen && !mycon->skip && !mycon->drop) {
+    // Still clean, so someone else can use it
+    mpd_release(mycon);
+  }
+  mycon->connecting = 0;
+  mycon->greeting = mycon->quiet = 0;
+  mycon->borrow = mycon->pinned = 0;
+  // Responses MPD owed won't come now, nor will their tags
+  mycon->responses += mycon->pending;
+  mycon->tagsent = 0;
+  tag_drop(mycon);
+  mycon->pending = mycon->inlist = mycon->idling = 0;
+  mycon->booting = 0;
+  free(mycon->bootlib);
+  mycon->bootlib = NULL;
+  mpd_unsubscribe(mycon);
+  if (mycon->capture) {
+    cache_captured(mycon, 0);
+  }
+  if (mycon->flight) {
+    flight_end(mycon, 1);
+  }
+  if (mycon->leader) {
+    flight_unfollow(mycon);
+  }
+  free(mycon->waiting);
+  mycon->waiting = NULL;
+  mycon->nocache = mycon->window = 0;
+  if (mycon->mpd) {
+    // Detach first - mongoose closes the socket on its next pass
+    mycon->mpd->fn_data = NULL;
+    mycon->mpd->is_closing = 1;
+    mg_activate(mycon->mpd);
+    mycon->mpd = NULL;
+  }
+  mpd_checkdrained(mycon);
+  mpd_flush(mycon);     // Nothing to write to now, but takes it off the outhead list
+  mycon->outlen = 0;
+  mpd_touch(mycon);
+  batch_flush(mycon);
+  if (mycon->binlen > 1 && !mycon->skip) {
+    // Part way through a binary frame, which can't be ended early, so the
+    // websocket can't be used any more
+    mycon->mgcon->is_draining = 1;
+    mg_activate(mycon->mgcon);
+  }
+  line_free(mycon);
+  mycon->drop = mycon->skip = 0;
+  mycon->binlen = mycon->pinged = 0;
+  return 0;
+}
+
+/**
+ * Write everything queued by mpd_send() to MPD in one syscall. Whatever the
+ * socket won't take now is passed to mongoose, which sends it when writable.
+ * If still looking up the name, the commands stay queued until we connect
+ */
+void mpd_flush(struct mycon *mycon) {
+  struct worker *w = mycon->worker;
+  if (mycon->outprev) {
+    mycon->outprev->outnext = mycon->outnext;
+  } else if (w->outhead == mycon) {
+    w->outhead = mycon->outnext;
+  }
+  if (mycon->outnext) {
+    mycon->outnext->outprev = mycon->outprev;
+  }
+  mycon->outprev = mycon->outnext = NULL;
+  struct mg_connection *c = mycon->mpd;
+  if (!c || !mycon->outlen) {
+    return;
+  }
+  size_t n = 0;
+  if (!c->is_connecting && !c->is_closing && !c->send.len) {
+    long r = send((int) (size_t) c->fd, mycon->out, mycon->outlen, 0);
+    if (r > 0) {
+      n = r;
+    }
+  }
+  if (n < mycon->outlen) {
+    // Partial write, connecting or already waiting to write: preserve order
+    // by queuing behind mongoose. A real error is picked up on its next write
+    mg_send(c, mycon->out + n, mycon->outlen - n);
+  }
+  mycon->outlen = 0;
+  if (mycon->outsize > MAXOUT) {
+    free(mycon->out);
+    mycon->out = NULL;
+    mycon->outsize = 0;
+  }
+}
+
+/**
+ * Queue a command for MPD until the end of this poll, so all frames from one
+ * read go together
+ */
+void mpd_queue(struct mycon *mycon, const char *buf, size_t len) {
+  struct worker *w = mycon->worker;
+  if (!mycon->outprev && w->outhead != mycon) {
+    mycon->outnext = w->outhead;
+    if (w->outhead) {
+      w->outhead->outprev = mycon;
+    }
+    w->outhead = mycon;
+  }
+  if (mycon->outlen + len + 1 > mycon->outsize) {
+    mycon->outsize = (mycon->outlen + len + 1) * 2;
+    mycon->out = realloc(mycon->out, mycon->outsize);
+  }
+  memcpy(mycon->out + mycon->outlen, buf, len);
+  mycon->out[mycon->outlen + len] = '\n';
+  mycon->outlen += len + 1;
+  mpd_touch(mycon);
+}
+
+/**
+ * Return true if a command has to wait for MPD to answer the ones sent before
+ * it, because the proxy answers it itself and the answer would come first.
+ * Not while in "idle", which could keep it waiting until something changes
+ */
+int mpd_wait(struct mycon *mycon, const char *buf, size_t len) {
+  static const char *verbs[] = { "search", "searchcount", NULL };
+  if ((!mycon->pending && !mycon->greeting) || mycon->idling) {
+    return 0;
+  }
+  return !strncmp(buf, "proxy-", 6) || cache_allowed(mycon, buf, len) || (command_is(buf, len, verbs) && library_find(mycon));
+}
+
+/**
+ * Send on the commands that were held while waiting, until one has to wait again
+ */
+void held_resume(struct mycon *mycon) {
+  if (mycon->resuming) {
+    // Sending one of them led here - the loop below carries on
+    return;
+  }
+  mycon->resuming = 1;
+  while (mycon->held.len && !mycon->leader && !mycon->bootlib) {
+    // Could be sharing another response before they've all gone
+    char *tag, *buf = (char *) mycon->held.buf;
+    size_t n = strlen(buf), len = n, taglen;
+    char *cmd = tag_command(buf, &len, &tag, &taglen);
+    if (mpd_wait(mycon, cmd, len)) {
+      break;
+    }
+    cmd = strndup(buf, n);
+    mg_iobuf_del(&mycon->held, 0, n + 1);
+    mpd_send(mycon, cmd, n);
+    free(cmd);
+  }
+  mycon->resuming = 0;
+}
+
+/**
+ * Find the end of an argument in quotes, skipping escaped characters as MPD does
+ * @param s the opening quote
+ * @return the closing quote, or NULL if there isn't one
+ */
+static char *arg_end(char *s) {
+  for (char *t=s+1;*t;t++) {
+    if (*t == '\\' && t[1]) {
+      t++;
+    } else if (*t == *s) {
+      return t;
+    }
+  }
+  return NULL;
+}
+
+/**
+ * Send MPD's greeting as the first line of the response to proxy-bootstrap
+ */
+static void bootstrap_hello(struct mycon *mycon, const char *hello) {
+  char *line = mg_mprintf("hello: %s", hello);
+  ws_line(mycon, line, strlen(line));
+  free(line);
+}
+
+/**
+ * Connect to a server by name for proxy-connect or proxy-bootstrap. The
+ * greeting answers proxy-connect, and is the "hello" line of proxy-bootstrap
+ * @return true if connected, or connecting
+ */
+static int proxy_connect(struct mycon *mycon, const char *cmd, const char *name) {
+  // Copy the host so the lock isn't held while connecting
+  struct myhost host = { .port = 0 };
+  pthread_rwlock_rdlock(&hostlock);
+  for (struct myhost *h = hostroot;h;h=h->next) {
+    if (!strcmp(name, h->name)) {
+      host = *h;
+      break;
+    }
+  }
+  pthread_rwlock_unlock(&hostlock);
+  if (!host.port) {
+    ws_printf(mycon, "ACK [0@0] {%s} no server name \"%s\"", cmd, name);
+    return 0;
+  }
+  int boot = !strcmp(cmd, "proxy-bootstrap");
+  mpd_flush(mycon);         // Commands before this one still go to the old server
+  mpd_disconnect(mycon);
+  mycon->host = host;
+  if (poolsize && mpd_borrow(mycon)) {
+    // Already connected, so answer with the greeting from when we did
+    if (boot) {
+      bootstrap_hello(mycon, mycon->hello);
+    } else {
+      ws_printf(mycon, "%s", mycon->hello);
+    }
+    mycon->borrow = 1;
+    mpd_release(mycon);
+  } else if (mpd_connect(mycon, &host)) {
+    mpd_connect_failed(mycon, strerror(errno));
+    return 0;
+  } else {
+    // The rest of proxy-bootstrap is the response, so the greeting isn't one
+    mycon->quiet = mycon->booting = boot;
+  }
+  return 1;
+}
+
+static void bootstrap_sent(void *arg, const char *line, size_t len) {
+  if (len == 2 && !memcmp(line, "OK", 2)) {
+    ws_line((struct mycon *) arg, "list_OK", 7);
+  } else {
+    ws_line((struct mycon *) arg, line, len);
+  }
+}
+
+/**
+ * MPD has answered its part of proxy-bootstrap, except for the final OK, so
+ * answer the searches from the library. Any it can't answer go to MPD after all
+ */
+static void bootstrap_library(struct mycon *mycon) {
+  struct library *lib = library_find(mycon);
+  char *cmd = mycon->bootlib, *t = cmd;
+  mycon->bootlib = NULL;
+  while (*t) {
+    char *eol = strchr(t, '\n');
+    if (!lib || !library_query(lib, t, eol - t, bootstrap_sent, mycon)) {
+      char *list = mg_mprintf("command_list_ok_begin\n%scommand_list_end", t);
+      mpd_command(mycon, list, strlen(list));
+      free(list);
+      break;
+    }
+    t = eol + 1;
+  }
+  if (!*t) {
+    ws_line(mycon, "OK", 2);
+  }
+  free(cmd);
+}
+
+/**
+ * Connect to a server and send everything a client needs to show it as one
+ * response, as if a command list: the greeting as "hello", then "stats",
+ * "listpartitions", "listplaylists", "status", "outputs",
+ * "replay_gain_status" and "playlistinfo", each ending "list_OK". If
+ * followed by the arguments of a search, the "searchcount" of its filter and
+ * the search come next, from the library if it can
+ * @param arg the name in quotes, then any search arguments
+ */
+static void proxy_bootstrap(struct mycon *mycon, char *arg) {
+  char *end = arg_end(arg), *filter = end + 1, *filterend = NULL;
+  while (*filter == ' ') {
+    filter++;
+  }
+  if ((*filter && *filter != '"' && *filter != '\'') || (*filter && !(filterend = arg_end(filter)))) {
+    ws_printf(mycon, "ACK [0@0] {proxy-bootstrap} bad search \"%s\"", filter);
+    return;
+  }
+  // Unescape the name as MPD would
+  char *name = arg + 1, *t = name;
+  *end = 0;
+  for (char *s=name;*s;s++) {
+    if (*s == '\\' && s[1]) {
+      s++;
+    }
+    *t++ = *s;
+  }
+  *t = 0;
+  if (!proxy_connect(mycon, "proxy-bootstrap", name)) {
+    return;
+  }
+  char *search = *filter ? mg_mprintf("searchcount %.*s\nsearch %s\n", (int) (filterend + 1 - filter), filter, filter) : strdup("");
+  int later = *filter && !mycon->nocache && library_find(mycon);
+  char *list = mg_mprintf("command_list_ok_begin\nstats\nlistpartitions\nlistplaylists\nstatus\noutputs\nreplay_gain_status\nplaylistinfo\n%scommand_list_end", later ? "" : search);
+  if (later) {
+    mycon->bootlib = search;
+  } else {
+    free(search);
+  }
+  mpd_command(mycon, list, strlen(list));
+  free(list);
+}
+
+/**
+ * Handle a text message from the client: a command or command list, tagged
+ * with "proxy-tag tag " if the client wants to know which response is which
+ */
+int mpd_send(struct mycon *mycon, char *buf, int len) {
+  static const char *answered[] = { "proxy-listservers", "proxy-stats", "proxy-format", "proxy-subscribe", NULL };
+  char *tag;
+  size_t n = len, taglen;
+  char *cmd = tag_command(buf, &n, &tag, &taglen);
+  if (mycon->leader || mycon->bootlib || (mycon->held.len && !mycon->resuming) || mpd_wait(mycon, cmd, n)) {
+    // Answered once the response being shared has been, or the ones before it
+    mg_iobuf_add(&mycon->held, mycon->held.len, buf, len);
+    mg_iobuf_add(&mycon->held, mycon->held.len, "", 1);
+    return 0;
+  }
+  // The responses it's owed. Anything the proxy answers itself is one, and
+  // so is the "disconnected" error to commands for MPD that it sends instead
+  int inlist = mycon->inlist;
+  unsigned long count = strncmp(cmd, "proxy-", 6) ? command_responses(cmd, n, &inlist) : 1;
+  if (!count && !mycon->mpd && !mycon->resolve && !mycon->borrow) {
+    count = 1;
+  }
+  unsigned long r = mycon->requests;
+  size_t at = mycon->tags.len;
+  if (mycon->idling && command_is(cmd, n, answered)) {
+    // Answered now, ahead of the response to "idle", so it takes that one's place
+    r = mycon->responses;
+    at = 0;
+    for (size_t i=0;i<mycon->tags.len;i+=sizeof(r) + strlen((char *) mycon->tags.buf + i + sizeof(r)) + 1) {
+      unsigned long k;
+      memcpy(&k, mycon->tags.buf + i, sizeof(k));
+      k += count;
+      memcpy(mycon->tags.buf + i, &k, sizeof(k));
+    }
+  }
+  for (unsigned long i=0;tag && i<count;i++, r++) {
+    // Each response to the frame is tagged
+    at += mg_iobuf_add(&mycon->tags, at, &r, sizeof(r));
+    at += mg_iobuf_add(&mycon->tags, at, tag, taglen);
+    at += mg_iobuf_add(&mycon->tags, at, "", 1);
+  }
+  mycon->requests += count;
+  return mpd_command(mycon, cmd, n);
+}
+
+/**
+ * Send a command to MPD, or answer it here if we can
+ */
+int mpd_command(struct mycon *mycon, char *buf, int len) {
+  // Anything answered here follows whatever's been received from MPD
+  batch_flush(mycon);
+  if (!strcmp(buf, "proxy-listservers")) {
+    pthread_rwlock_rdlock(&hostlock);
+    for (struct myhost *h = hostroot;h;h=h->next) {
+      ws_printf(mycon, "name: %s", h->name);
+      ws_printf(mycon, "host: %s", h->host);
+      ws_printf(mycon, "port: %d", h->port);
+    }
+    pthread_rwlock_unlock(&hostlock);
+    ws_printf(mycon, "OK");
+  } else if (!strcmp(buf, "proxy-stats")) {
+    uint64_t stalltime = mycon->stalltime + (mycon->stalled ? mg_millis() - mycon->stalled : 0);
+    ws_printf(mycon, "id: %lu", mycon->mgcon->id);
+    ws_printf(mycon, "sendbuf: %lu", (unsigned long) mycon->mgcon->send.len);
+    ws_printf(mycon, "sendbuf_max: %lu", (unsigned long) mycon->sendmax);
+    ws_printf(mycon, "stalled: %d", mycon->stalled ? 1 : 0);
+    ws_printf(mycon, "stalls: %u", mycon->stalls);
+    ws_printf(mycon, "stall_time: %lu", (unsigned long) stalltime);
+    int pooled = 0;
+    for (struct pooled *p=mycon->worker->pool;p;p=p->next) {
+      pooled++;
+    }
+    ws_printf(mycon, "pinned: %d", mycon->pinned);
+    ws_printf(mycon, "pooled: %d", pooled);
+    ws_printf(mycon, "coalesced: %lu", mycon->worker->coalesced);
+    ws_printf(mycon, "library_answered: %lu", mycon->worker->libanswered);
+    ws_printf(mycon, "library_passed: %lu", mycon->worker->libpassed);
+    for (struct watcher *wt=mycon->worker->watchers;wt;wt=wt->next) {
+      if (wt->library && wt->host.port == mycon->host.port && !strcmp(wt->host.host, mycon->host.host)) {
+        ws_printf(mycon, "library_songs: %lu", (unsigned long) library_tracks(wt->library));
+        ws_printf(mycon, "library_bytes: %lu", (unsigned long) library_bytes(wt->library));
+      }
+    }
+    ws_printf(mycon, "OK");
+  } else if (!strncmp(buf, "proxy-format ", 13)) {
+    char *t = buf + 13;
+    char *t2;
+    if (!strcmp(t, "lines")) {
+      mycon->format = FORMAT_LINES;
+      ws_printf(mycon, "OK");
+    } else if (!strncmp(t, "batch", 5) && (!t[5] || (t[5] == ' ' && strtol(t + 6, &t2, 10) > 0 && !*t2))) {
+      mycon->format = FORMAT_BATCH;
+      mycon->batchlimit = t[5] ? strtol(t + 6, NULL, 10) : BATCHLIMIT;
+      ws_printf(mycon, "OK");
+    } else if (!strncmp(t, "json", 4) && (!t[4] || (t[4] == ' ' && strtol(t + 5, &t2, 10) > 0 && !*t2))) {
+      if (!mycon->json) {
+        mycon->json = calloc(1, sizeof(struct json));
+      }
+      mycon->format = FORMAT_JSON;
+      mycon->batchlimit = t[4] ? strtol(t + 5, NULL, 10) : BATCHLIMIT;
+      ws_printf(mycon, "OK");
+    } else {
+      ws_printf(mycon, "ACK [0@0] {proxy-format} unknown format \"%s\"", t);
+    }
+  } else if (!strncmp(buf, "proxy-subscribe", 15) && (len == 15 || (len > 17 && buf[15] == ' ' && (buf[16] == '"' || buf[16] == '\'') && buf[len-1] == buf[16]))) {
+    if (!mycon->mpd && !mycon->resolve && !mycon->borrow) {
+      ws_printf(mycon, "ACK [0@0] {proxy-subscribe} disconnected");
+    } else {
+      char *name = "default";
+      if (len > 15) {
+        // Unescape the name as MPD would
+        char *t = name = buf + 17;
+        buf[len - 1] = 0;
+        for (char *s=name;*s;s++) {
+          if (*s == '\\' && s[1]) {
+            s++;
+          }
+          *t++ = *s;
+        }
+        *t = 0;
+      }
+      mpd_subscribe(mycon, name);
+      ws_printf(mycon, "OK");
+    }
+  } else if (!strncmp(buf, "proxy-connect ", 14) && (buf[14] == '"' || buf[14] == '\'') && buf[len-1] == buf[14]) {
+    buf[len - 1] = 0;
+    proxy_connect(mycon, "proxy-connect", buf + 15);
+  } else if (!strncmp(buf, "proxy-bootstrap ", 16) && (buf[16] == '"' || buf[16] == '\'') && arg_end(buf + 16)) {
+    proxy_bootstrap(mycon, buf + 16);
+  } else if (!mycon->mpd && !mycon->resolve && !mycon->borrow) {
+    int oldv = buf[len];
+    int inlist = mycon->inlist;
+    unsigned long count = command_responses(buf, len, &inlist);
+    buf[len] = 0;
+    for (unsigned long i=0;i<count || !i;i++) {
+      ws_printf(mycon, "ACK [0@0] {%s} disconnected", buf);
+    }
+    buf[len] = oldv;
+  } else {
+#if DEBUG
+    printf("TX \"%.*s\"\n", len, buf);
+#endif
+    if (!mycon->pending && !mycon->greeting && library_reply(mycon, buf, len)) {
+      return 0;
+    }
+    if (!mycon->pending && !mycon->greeting && flight_allowed(mycon, buf, len)) {
+      // Nothing else to answer first, so the next response is this one's
+      int cache = cache_allowed(mycon, buf, len);
+      long from, to;
+      size_t n = cache ? cache_window(buf, len, &from, &to) : 0;
+      if (cache && cache_toobig(mycon, buf, n ? n : (size_t) len)) {
+        // Asking for every record would only fetch what can't be kept
+        cache = 0;
+        n = 0;
+      }
+      if (cache && cache_reply(mycon, buf, n ? n : (size_t) len, n ? from : -1, to)) {
+        return 0;
+      }
+      if (n) {
+        // Ask for every record, and send the client the ones it wants
+        mycon->window = 1;
+        mycon->windowfrom = from;
+        mycon->windowto = to;
+        mycon->windowrec = 0;
+        mycon->windowkeylen = 0;
+      }
+      struct mycon *leader = flight_find(mycon, buf, n ? n : (size_t) len);
+      if (leader) {
+        // Already on its way to another client, so share that
+        flight_follow(mycon, leader);
+        mycon->waiting = strndup(buf, len);
+        mycon->worker->coalesced++;
+        return 0;
+      }
+      flight_start(mycon, buf, n ? n : (size_t) len);
+      if (cache) {
+        cache_capture(mycon, buf, n ? n : (size_t) len);
+      }
+      if (n) {
+        len = n;
+      }
+    }
+    mpd_count(mycon, buf, len);
+    if (!mycon->mpd && !mycon->resolve && !mpd_borrow(mycon)) {
+      // Nothing idle in the pool for this server, so make another connection
+      mycon->quiet = 1;
+      if (mpd_connect(mycon, &mycon->host)) {
+        mpd_connect_failed(mycon, strerror(errno));
+        return 1;
+      }
+    }
+    mpd_queue(mycon, buf, len);
+    return 0;
+  }
+  return 1;
+}
+
+/**
+ * Stop reading from MPD if the client has too much waiting to be sent, so
+ * TCP flow control pushes back on MPD rather than the proxy buffering it
+ */
+void mpd_checkfull(struct mycon *mycon) {
+  size_t len = mycon->mgcon->send.len;
+  if (len > mycon->sendmax) {
+    mycon->sendmax = len;
+  }
+  if (mycon->mpd && !mycon->mpd->is_full && len > HIGHWATER) {
+    mycon->mpd->is_full = 1;
+    mycon->stalls++;
+    mycon->stalled = mg_millis();
+  }
+}
 
-static char *bindaddr = "0.0.0.0";
-static int port = 8000;
-static char *rootdir = NULL;
+/**
+ * Resume reading from MPD once the client has drained enough, or when
+ * detaching from MPD
+ */
+void mpd_checkdrained(struct mycon *mycon) {
+  if (mycon->stalled && (!mycon->mpd || mycon->mgcon->send.len <= LOWWATER)) {
+    if (mycon->mpd) {
+      mycon->mpd->is_full = 0;
+      mg_activate(mycon->mpd);
+    }
+    mycon->stalltime += mg_millis() - mycon->stalled;
+    mycon->stalled = 0;
+  }
+}
 
-struct myhost {
-  char name[100];
-  char host[100];
-  int port;
-  struct myhost *next;
-};
+/**
+ * Make room for a line of len bytes (plus terminator) in mycon->buf. Up
+ * to LINEBLOCK comes from the worker's pool, longer lines grow from there
+ */
+void line_reserve(struct mycon *mycon, size_t len) {
+  struct worker *w = mycon->worker;
+  if (len + 1 <= mycon->bufsize) {
+    return;
+  } else if (!mycon->buf && len + 1 <= LINEBLOCK && w->linepool) {
+    mycon->buf = w->linepool;
+    memcpy(&w->linepool, mycon->buf, sizeof(char *));
+    w->linepooled--;
+    mycon->bufsize = LINEBLOCK;
+  } else {
+    size_t size = mycon->bufsize ? mycon->bufsize * 2 : LINEBLOCK;
+    while (size < len + 1) {
+      size *= 2;
+    }
+    char *buf = malloc(size);
+    size_t off = mycon->off;
+    if (off) {
+      memcpy(buf, mycon->buf, off);
+    }
+    line_free(mycon);
+    mycon->buf = buf;
+    mycon->bufsize = size;
+    mycon->off = off;
+  }
+}
 
-struct mycon {
-  struct mg_connection *mgcon;
-  int mpdfd;
-  char buf[MAXLINE];
-  char *binbuf;
-  int off, binoff, binlen, pinged;
-  time_t ping;
-  struct mycon *next;
-};
+/**
+ * Release mycon->buf, returning it to the pool if it's the usual size
+ */
+void line_free(struct mycon *mycon) {
+  struct worker *w = mycon->worker;
+  if (mycon->bufsize == LINEBLOCK && w->linepooled < LINEPOOL) {
+    memcpy(mycon->buf, &w->linepool, sizeof(char *));
+    w->linepool = mycon->buf;
+    w->linepooled++;
+  } else {
+    free(mycon->buf);
+  }
+  mycon->buf = NULL;
+  mycon->off = mycon->bufsize = 0;
+}
 
-struct mycon *root = NULL;
-struct myhost *hostroot = NULL;
-#ifdef AVAHI
-static AvahiSimplePoll *avahipoll = NULL;
-#endif
+/**
+ * Add a JSON string to the buffer, escaping as required
+ */
+static void json_string(struct mg_iobuf *io, const char *s, size_t len) {
+  static const char hex[] = "0123456789abcdef";
+  mg_iobuf_add(io, io->len, "\"", 1);
+  size_t start = 0;
+  for (size_t i=0;i<len;i++) {
+    unsigned char c = s[i];
+    if (c < 0x20 || c == '"' || c == '\\') {
+      char esc[6] = { '\\', c, 0, 0, 0, 0 };
+      size_t esclen = 2;
+      if (c == '\n') {
+        esc[1] = 'n';
+      } else if (c == '\t') {
+        esc[1] = 't';
+      } else if (c < 0x20) {
+        esc[1] = 'u';
+        esc[2] = esc[3] = '0';
+        esc[4] = hex[c >> 4];
+        esc[5] = hex[c & 15];
+        esclen = 6;
+      }
+      mg_iobuf_add(io, io->len, s + start, i - start);
+      mg_iobuf_add(io, io->len, esc, esclen);
+      start = i + 1;
+    }
+  }
+  mg_iobuf_add(io, io->len, s + start, len - start);
+  mg_iobuf_add(io, io->len, "\"", 1);
+}
 
-int mpd_connect(struct mycon *con, const char *host, const int port) {
-  int fd = socket(AF_INET, SOCK_STREAM, 0);
-  if (fd < 0) {
-    perror("socket");
-    return 1;
+/**
+ * Start the next entry in the records array of the FORMAT_JSON frame
+ */
+static void json_entry(struct mycon *mycon) {
+  struct mg_iobuf *io = &mycon->batch;
+  if (mycon->json->nrecords++) {
+    mg_iobuf_add(io, io->len, ",", 1);
+  } else {
+    mg_iobuf_add(io, io->len, "{\"records\":[", 12);
   }
-  fcntl(fd, F_SETFL, O_NONBLOCK);
+}
 
-  struct addrinfo *addrinfo;
-  if (getaddrinfo(host, NULL, NULL, &addrinfo)) {
-    perror("geraddrinfo");
-    return 1;
+/**
+ * Add the record being built to the FORMAT_JSON frame. Each record is an
+ * array of values indexed by key: null if the key is missing, 0 if the
+ * same as the previous record, and an array if the key is repeated.
+ * Missing keys at the end are left off
+ */
+static void json_record(struct mycon *mycon) {
+  struct json *j = mycon->json;
+  struct mg_iobuf *io = &mycon->batch;
+  if (!j->pending) {
+    return;
   }
-  struct sockaddr_in *addr = NULL;
-  for (struct addrinfo *r=addrinfo;r;r=r->ai_next) {
-    char address[INET6_ADDRSTRLEN];
-    if (r->ai_family == AF_INET) {
-      if (!inet_ntop(AF_INET, &((struct sockaddr_in *)r->ai_addr)->sin_addr, address, sizeof(address))) {
-        perror("inet_ntop");
-        freeaddrinfo(addrinfo);
-        return 1;
-      } else {
-        addr = calloc(sizeof(struct sockaddr_in), 1);
-        addr->sin_family = AF_INET;
-        addr->sin_port = htons(port);
-        if (inet_pton(AF_INET, address, &addr->sin_addr) < 0) {
-          perror("inet_pton");
-          freeaddrinfo(addrinfo);
-          free(addr);
-          return 1;
+  j->pending = 0;
+  json_entry(mycon);
+  mg_iobuf_add(io, io->len, "[", 1);
+  int last = j->nkeys - 1;
+  while (!j->ncur[last]) {
+    last--;
+  }
+  for (int i=0;i<=last;i++) {
+    struct mg_iobuf *cur = &j->cur[i];
+    struct mg_iobuf *prev = &j->prev[i];
+    if (i) {
+      mg_iobuf_add(io, io->len, ",", 1);
+    }
+    if (!j->ncur[i]) {
+      mg_iobuf_add(io, io->len, "null", 4);
+    } else if (j->ncur[i] == j->nprev[i] && cur->len == prev->len && !memcmp(cur->buf, prev->buf, cur->len)) {
+      mg_iobuf_add(io, io->len, "0", 1);
+    } else if (j->ncur[i] == 1) {
+      json_string(io, (char *) cur->buf, cur->len - 1);
+    } else {
+      mg_iobuf_add(io, io->len, "[", 1);
+      for (char *v=(char *) cur->buf;v<(char *) cur->buf + cur->len;v+=strlen(v) + 1) {
+        if (v != (char *) cur->buf) {
+          mg_iobuf_add(io, io->len, ",", 1);
         }
+        json_string(io, v, strlen(v));
       }
-      break;
+      mg_iobuf_add(io, io->len, "]", 1);
     }
   }
-  freeaddrinfo(addrinfo);
-  if (!addr) {
-    fprintf(stderr, "can't resolve \"%s\"", host);
-    return 1;
+  mg_iobuf_add(io, io->len, "]", 1);
+  // The values become the previous record's, and the buffers are reused
+  for (int i=0;i<j->nkeys;i++) {
+    struct mg_iobuf t = j->prev[i];
+    j->prev[i] = j->cur[i];
+    j->cur[i] = t;
+    j->cur[i].len = 0;
+    j->nprev[i] = j->ncur[i];
+    j->ncur[i] = 0;
   }
+}
 
-  // Connect to socket with 3s timeout
-  fd_set fdset;
-  FD_ZERO(&fdset);
-  FD_SET(fd, &fdset);
-  int r;
-  struct timeval tv = {.tv_sec=3, .tv_usec=0 };
-  connect(fd, (struct sockaddr *)addr, sizeof(struct sockaddr_in));
-  free(addr);
-  if (errno == EINPROGRESS) {
-    if ((r=select(fd + 1, NULL, &fdset, NULL, &tv)) == 1) {
-      socklen_t len = sizeof(r);
-      if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &r, &len)) {
-        perror("getsockopt");
-        return 1;
-      }
-      if (r) {
-        errno = r;
-        perror("connect/getsockopt");
-        return 1;
+/**
+ * Send the FORMAT_JSON frame collected so far. Each frame has its own keys,
+ * so can be read without the ones before it
+ * @param end the line that ends the response, or NULL if there's more to come
+ */
+static void json_flush(struct mycon *mycon, const char *end, size_t endlen) {
+  struct json *j = mycon->json;
+  struct mg_iobuf *io = &mycon->batch;
+  json_record(mycon);
+  if (!j->nrecords && !end) {
+    return;
+  }
+  if (!j->nrecords) {
+    mg_iobuf_add(io, io->len, "{\"records\":[", 12);
+  }
+  mg_iobuf_add(io, io->len, "],\"keys\":[", 10);
+  for (int i=0;i<j->nkeys;i++) {
+    if (i) {
+      mg_iobuf_add(io, io->len, ",", 1);
+    }
+    json_string(io, j->keys[i], strlen(j->keys[i]));
+    free(j->keys[i]);
+    j->cur[i].len = j->prev[i].len = 0;
+    j->ncur[i] = j->nprev[i] = 0;
+  }
+  mg_iobuf_add(io, io->len, "]", 1);
+  if (end) {
+    mg_iobuf_add(io, io->len, ",\"end\":", 7);
+    json_string(io, end, endlen);
+    free(j->recordkey);
+    j->recordkey = NULL;
+  }
+  mg_iobuf_add(io, io->len, "}", 1);
+  ws_send(mycon, (char *) io->buf, io->len);
+  io->len = 0;
+  j->nkeys = j->nrecords = 0;
+}
+
+/**
+ * Add a line from MPD to the FORMAT_JSON frame
+ */
+static void json_line(struct mycon *mycon, const char *line, size_t len) {
+  struct json *j = mycon->json;
+  const char *sep = memmem(line, len, ": ", 2);
+  if (line_isend(line, len)) {
+    json_flush(mycon, line, len);
+    return;
+  }
+  int i = 0;
+  if (sep) {
+    size_t klen = sep - line;
+    if (!j->recordkey) {
+      j->recordkey = strndup(line, klen);
+      j->entity = !strcmp(j->recordkey, "file") || !strcmp(j->recordkey, "directory") || !strcmp(j->recordkey, "playlist");
+    }
+    if ((klen == strlen(j->recordkey) && !memcmp(line, j->recordkey, klen)) || (j->entity && ((klen == 4 && !memcmp(line, "file", 4)) || (klen == 9 && !memcmp(line, "directory", 9)) || (klen == 8 && !memcmp(line, "playlist", 8))))) {
+      // Start of a new record - the only place a frame is split
+      json_record(mycon);
+      if (mycon->batch.len >= mycon->batchlimit) {
+        json_flush(mycon, NULL, 0);
       }
-      // connected
-    } else if (r < 0) {
-      perror("select");
-      return 1;
-    } else {
-      errno = ETIMEDOUT;
-      fprintf(stderr, "timeout connecting to \"%s\" port %d\n", host, port);
-      return 1;
     }
-  } else {
-    perror("connect");
-    return 1;
+    while (i < j->nkeys && (strncmp(j->keys[i], line, klen) || j->keys[i][klen])) {
+      i++;
+    }
+    if (i == j->nkeys && i < MAXKEYS) {
+      j->keys[j->nkeys++] = strndup(line, klen);
+    }
   }
-  r = 1;
-  if (setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &r, sizeof(r))) {
-    perror("setsockopt");
+  if (!sep || i == MAXKEYS) {
+    // Not a "key: value" line, or too many keys - add it to the records as a string
+    json_record(mycon);
+    json_entry(mycon);
+    json_string(&mycon->batch, line, len);
+    if (len == 7 && !memcmp(line, "list_OK", 7)) {
+      // The next command in the list has records of its own
+      free(j->recordkey);
+      j->recordkey = NULL;
+    }
+    return;
   }
-  con->mpdfd = fd;
-  con->ping = time(NULL);
-  return 0;
+  struct mg_iobuf *cur = &j->cur[i];
+  mg_iobuf_add(cur, cur->len, sep + 2, len - (sep + 2 - line));
+  mg_iobuf_add(cur, cur->len, "", 1);
+  j->ncur[i]++;
+  j->pending = 1;
 }
 
-int mpd_disconnect(struct mycon *mycon) {
-  if (mycon->mpdfd > 0) {
-    close(mycon->mpdfd);
-    mycon->mpdfd = 0;
+/**
+ * Send whatever's been collected in FORMAT_BATCH or FORMAT_JSON as a frame of its own
+ */
+void batch_flush(struct mycon *mycon) {
+  if (mycon->format == FORMAT_JSON) {
+    json_flush(mycon, NULL, 0);
+  } else if (mycon->batch.len) {
+    // Without the final newline
+    ws_send(mycon, (char *) mycon->batch.buf, mycon->batch.len - 1);
+    mycon->batch.len = 0;
   }
-  return 0;
 }
 
-int mpd_send(struct mycon *mycon, char *buf, int len) {
-  if (!strcmp(buf, "proxy-listservers")) {
-    for (struct myhost *h = hostroot;h;h=h->next) {
-      mg_ws_printf(mycon->mgcon, WEBSOCKET_OP_TEXT, "name: %s", h->name);
-      mg_ws_printf(mycon->mgcon, WEBSOCKET_OP_TEXT, "host: %s", h->host);
-      mg_ws_printf(mycon->mgcon, WEBSOCKET_OP_TEXT, "port: %d", h->port);
+/**
+ * Send a line from MPD to the client: as a frame of its own, or in
+ * FORMAT_BATCH, as part of one frame for the whole response
+ */
+void ws_line(struct mycon *mycon, const char *line, size_t len) {
+  tag_line(mycon, line, len, mycon->format == FORMAT_BATCH);
+  if (mycon->format == FORMAT_LINES) {
+    ws_send(mycon, line, len);
+    return;
+  } else if (mycon->format == FORMAT_JSON) {
+    json_line(mycon, line, len);
+    return;
+  }
+  if (mycon->batch.len && mycon->batch.len + len + 1 > mycon->batchlimit) {
+    batch_flush(mycon);
+  }
+  mg_iobuf_add(&mycon->batch, mycon->batch.len, line, len);
+  mg_iobuf_add(&mycon->batch, mycon->batch.len, "\n", 1);
+  if (line_isend(line, len)) {
+    // End of the response
+    batch_flush(mycon);
+  }
+}
+
+/**
+ * Handle a complete line from MPD, without the newline. The line must be
+ * writable as it's terminated in place
+ */
+void mpd_line(struct mycon *mycon, char *line, size_t len) {
+  line[len] = 0;
+  if (len > 8 && !memcmp(line, "binary: ", 8)) {
+    // Read "binary: n" - if n is a positive number,
+    // don't send that line but prepare for n-byte of binary data
+    char *t = line + 8;
+    char *t2;
+    long val = strtol(t, &t2, 10);
+    if (val > 0 && !*t2) {
+      mycon->binlen = val + 1;
+      if (mycon->capture) {
+        cache_captured(mycon, 0);
+      }
+      if (mycon->flight) {
+        flight_end(mycon, 1);
+      }
+      if (!mycon->skip) {
+        batch_flush(mycon);
+        ws_begin(mycon->mgcon, val, WEBSOCKET_OP_BINARY);
+      }
     }
-    mg_ws_printf(mycon->mgcon, WEBSOCKET_OP_TEXT, "OK");
-  } else if (!strncmp(buf, "proxy-connect ", 14) && (buf[14] == '"' || buf[14] == '\'') && buf[len-1] == buf[14]) {
-    char *name = buf + 15;
-    buf[len - 1] = 0;
-    for (struct myhost *h = hostroot;h;h=h->next) {
-      if (!strcmp(name, h->name)) {
-        mpd_disconnect(mycon);
-        if (mpd_connect(mycon, h->host, h->port)) {
-          mg_ws_printf(mycon->mgcon, WEBSOCKET_OP_TEXT, "ACK [0@0] {proxy-connect} connection to name \"%s\" host \"%s\" port %d failed: %s", h->name, h->host, h->port, strerror(errno));
-          mpd_disconnect(mycon);
+  }
+  if (!mycon->binlen && mycon->pinged) {
+    // Keep quiet about the OK in response to ping, which was sent when
+    // nothing else was waiting so it comes first
+    mycon->pinged = !line_isend(line, len);
+  } else if (!mycon->binlen) {
+    // Full line other than "binary: n" - send it
+    if (mycon->greeting && len > 7 && !memcmp(line, "OK MPD ", 7)) {
+      // Kept to answer proxy-connect if this connection is pooled
+      mycon->greeting = 0;
+      snprintf(mycon->hello, sizeof(mycon->hello), "%s", line);
+      mycon->borrow = poolsize > 0;
+      if (mycon->quiet) {
+        mycon->quiet = 0;
+        if (mycon->booting) {
+          mycon->booting = 0;
+          bootstrap_hello(mycon, line);
         }
-        name = NULL;
-        break;
+        return;
+      }
+    } else if (mycon->pending && line_isend(line, len)) {
+      mycon->pending--;
+      mycon->idling &= mycon->pending > 0;
+      if (mycon->bootlib && !mycon->pending && len == 2 && !memcmp(line, "OK", 2)) {
+        // Not the end of proxy-bootstrap yet - the library has the rest
+        bootstrap_library(mycon);
+        return;
+      }
+      if (!mycon->pending) {
+        free(mycon->bootlib);
+        mycon->bootlib = NULL;
       }
     }
-    if (name) {
-      mg_ws_printf(mycon->mgcon, WEBSOCKET_OP_TEXT, "ACK [0@0] {proxy-connect} no server name \"%s\"", name);
-    }
-  } else if (!mycon->mpdfd) {
-    int oldv = buf[len];
-    buf[len] = 0;
-    mg_ws_printf(mycon->mgcon, WEBSOCKET_OP_TEXT, "ACK [0@0] {%s} disconnected", buf);
-    buf[len] = oldv;
-  } else {
-    int oldv = buf[len];
-#if DEBUG
-    printf("TX \"%s\"\n", buf);
-#endif
-    buf[len] = '\n';
-    if (write(mycon->mpdfd, buf, len + 1) != len + 1) {
-      perror("write");
-      mpd_disconnect(mycon);
-      return 1;
+    if (mycon->skip) {
+      // Lost a line, so the response is incomplete - replace its end with an error
+      if (!strcmp(line, "OK") || !strncmp(line, "ACK ", 4)) {
+        char tbuf[80];
+        mycon->skip = 0;
+        mycon->window = 0;
+        if (mycon->capture) {
+          cache_captured(mycon, 0);
+        }
+        if (mycon->flight) {
+          flight_end(mycon, 1);
+        }
+        ws_line(mycon, tbuf, snprintf(tbuf, sizeof(tbuf), "ACK [0@0] {} line from MPD longer than %lu bytes", (unsigned long) maxline));
+      }
+    } else if (mycon->capture || mycon->window || mycon->flight) {
+      cache_line(mycon, line, len);
+    } else {
+      ws_line(mycon, line, len);
     }
-    mycon->ping = time(NULL);
-    buf[len] = oldv;
-    return 0;
   }
-  return 1;
 }
+
 /**
- * Read from the connection and if it's a full line
+ * Consume whatever mongoose has read from the MPD connection and if it's a full line
  * (or full binary bloc), send it to the websocket
  */
 void mpd_poll(struct mycon *mycon) {
-  if (!mycon->mpdfd) {
+  struct mg_iobuf *io = &mycon->mpd->recv;
+  char *p = (char *) io->buf, *end = p + io->len;
+  if (p == end) {
     return;
   }
-  static char buf[32768];
-  memset(buf, 0, sizeof(buf));
-  int len = read(mycon->mpdfd, buf, sizeof(buf) - 1);
-
-  if (len < 0) {
-    mpd_disconnect(mycon);
-    perror("read");
-  } else if (len > 0) {
 #if DEBUG
-    printf("RX \"%s\"\n", buf);
+  printf("RX \"%.*s\"\n", (int) io->len, (char *) io->buf);
 #endif
-    mycon->ping = time(NULL);
-    for (int i=0;i<len;i++) {
-      char c = buf[i];
-      if (mycon->binbuf) {
-        // Reading a binary message
-        mycon->binbuf[mycon->binoff++] = c;
-        if (mycon->binoff == mycon->binlen) { 
-          mg_ws_send(mycon->mgcon, mycon->binbuf, mycon->binlen, WEBSOCKET_OP_BINARY);
-          free(mycon->binbuf);
-          mycon->binbuf = NULL;
-          mycon->binoff = 0;
-          mycon->binlen = 1;    // we need to eat a byte
-        }
-      } else if (mycon->binlen) {
-        mycon->binlen--;        // eat byte
+  mpd_touch(mycon);
+  while (p < end) {
+    if (mycon->binlen > 1) {
+      // Reading a binary message - straight into the frame started by mpd_line()
+      size_t n = mycon->binlen - 1;
+      if (n > (size_t) (end - p)) {
+        n = end - p;
+      }
+      if (!mycon->skip) {
+        mg_send(mycon->mgcon, p, n);
+      }
+      mycon->binlen -= n;
+      p += n;
+    } else if (mycon->binlen) {
+      mycon->binlen--;        // eat byte
+      p++;
+    } else {
+      char *eol = memchr(p, '\n', end - p);
+      size_t n = (eol ? eol : end) - p;
+      if (!mycon->drop && mycon->off + n > maxline) {
+        // Too long. Rather than split it, drop it and the rest of the response
+        line_free(mycon);
+        mycon->drop = mycon->skip = 1;
+      }
+      if (mycon->drop) {
+        p += n;
+      } else if (eol && !mycon->off) {
+        // The usual case: a whole line in this read, sent from where it is
+        mpd_line(mycon, p, n);
+        p += n;
       } else {
-        // Reading a text message
-        mycon->buf[mycon->off++] = c;
-        if (c == '\n' || mycon->off == sizeof(mycon->buf)) {
-          mycon->buf[mycon->off - 1] = 0;
-          if (!memcmp(mycon->buf, "binary: ", 8)) {
-            // Read "binary: n" - if n is a positive number,
-            // don't send that line but prepare for n-byte of binary data
-            char *t = mycon->buf + 8;
-            char *t2;
-            int val = strtol(t, &t2, 10);
-            if (val > 0 && !*t2) {
-              mycon->binbuf = calloc(val, 1);
-              mycon->binoff = 0;
-              mycon->binlen = val;
-            }
-          }
-          if (!mycon->binbuf) {
-            // Full line other than "binary: n" - send it
-            if (mycon->pinged) {
-              // keep quiet about OK in response tp ping
-              mycon->pinged = 0;
-            } else {
-              mg_ws_send(mycon->mgcon, mycon->buf, mycon->off - 1, WEBSOCKET_OP_TEXT);
-            }
-          }
-          mycon->off = 0;
+        // A line split across reads - copy it until we have the rest
+        line_reserve(mycon, mycon->off + n);
+        memcpy(mycon->buf + mycon->off, p, n);
+        mycon->off += n;
+        p += n;
+        if (eol) {
+          mpd_line(mycon, mycon->buf, mycon->off);
+          line_free(mycon);
         }
       }
+      if (eol) {
+        mycon->drop = 0;
+        p++;
+      }
+    }
+  }
+  // Everything's been consumed. Not mg_iobuf_del(), which would clear the buffer
+  io->len = 0;
+  mpd_checkfull(mycon);
+  if (mycon->events.len && !mycon->binlen) {
+    events_flush(mycon);
+  }
+  if (mycon->borrow && !mycon->pinned && !mycon->pending && !mycon->greeting && !mycon->pinged) {
+    // MPD has answered everything, so the connection can go back to the pool
+    mpd_release(mycon);
+  }
+  if (mycon->held.len && !mycon->leader && !mycon->bootlib) {
+    held_resume(mycon);
+  }
+}
+
+/**
+ * Callback for Mongoose event on an MPD connection
+ */
+static void mpdfn(struct mg_connection *c, int ev, void *ev_data, void *fn_data) {
+  struct mycon *mycon = (struct mycon *) fn_data;
+  if (!mycon) {
+    // Detached by mpd_disconnect, waiting to be closed
+  } else if (ev == MG_EV_CONNECT) {
+    // mongoose has already set TCP_NODELAY and SO_KEEPALIVE
+    mycon->connecting = 0;
+    mg_iobuf_resize(&c->recv, READSIZE);
+    mpd_touch(mycon);
+  } else if (ev == MG_EV_READ) {
+    // mongoose reads once per poll. While the reads fill the buffer there's
+    // likely more waiting, so keep going up to READBUDGET
+    long n = *(long *) ev_data;
+    size_t budget = READBUDGET;
+    mpd_poll(mycon);
+    while ((size_t) n == c->recv.size && n < (long) budget && !c->is_full && mycon->mpd == c) {
+      budget -= n;
+      n = mg_io_recv(c, c->recv.buf, c->recv.size);
+      if (n == MG_IO_WAIT) {
+        break;
+      } else if (n <= 0) {
+        c->is_closing = 1;      // As mongoose does
+        break;
+      }
+      c->recv.len = n;
+      mpd_poll(mycon);
+    }
+  } else if (ev == MG_EV_POLL) {
+    if (mycon->connecting && mg_millis() > mycon->deadline) {
+      mpd_connect_failed(mycon, strerror(ETIMEDOUT));
+    }
+  } else if (ev == MG_EV_ERROR) {
+    if (mycon->connecting) {
+      // Prefer the real reason to mongoose's "socket error"
+      int r = 0;
+      socklen_t len = sizeof(r);
+      if (getsockopt((int) (size_t) c->fd, SOL_SOCKET, SO_ERROR, &r, &len) || !r) {
+        mpd_connect_failed(mycon, (char *) ev_data);
+      } else {
+        mpd_connect_failed(mycon, strerror(r));
+      }
+    }
+  } else if (ev == MG_EV_CLOSE) {
+    // Closed by MPD or on error
+    mycon->mpd = NULL;
+    if (mycon->connecting) {
+      mpd_connect_failed(mycon, "connection closed");
+    } else {
+      // Answer whatever MPD still owed, unless part way through a binary frame
+      static const char *closed = "ACK [0@0] {} connection to MPD closed";
+      int n = mycon->pending + (mycon->greeting && !mycon->quiet);
+      for (int i=0;i<n && !mycon->binlen;i++) {
+        mycon->pending -= mycon->pending > 0;
+        ws_line(mycon, closed, strlen(closed));
+      }
+      mpd_disconnect(mycon);
+      held_resume(mycon);
     }
   }
 }
 
 /**
- * Callback for Mongoose web-server event
+ * Callback for Mongoose web-server event. fn_data is the worker for
+ * HTTP connections, and the mycon once upgraded to a websocket
  */
-static void fn(struct mg_connection *mgcon, int ev, void *ev_data, void *fn_data  __attribute__((unused))) {
+static void fn(struct mg_connection *mgcon, int ev, void *ev_data, void *fn_data) {
   if (ev == MG_EV_HTTP_MSG) {
     struct mg_http_message *hm = (struct mg_http_message *) ev_data;
     if (mg_http_match_uri(hm, "/ws")) {
       // Upgrade to websocket. From now on, a connection is a full-duplex
       // Websocket connection, which will receive MG_EV_WS_MSG events.
-      mg_ws_upgrade(mgcon, hm, NULL);
+      char *ext = NULL;
+#ifdef ZLIB
+      char tbuf[100];
+      int bits, reset;
+      ext = ws_negotiate(hm, tbuf, sizeof(tbuf), &bits, &reset);
+#endif
+      mg_ws_upgrade(mgcon, hm, ext ? "Sec-WebSocket-Extensions: %s\r\n" : NULL, ext);
+      if (mgcon->is_websocket) {
+        struct worker *w = (struct worker *) fn_data;
+        struct mycon *mycon = calloc(sizeof(struct mycon), 1);
+        mycon->worker = w;
+        mycon->mgcon = mgcon;
+#ifdef ZLIB
+        if (ext) {
+          mycon->deflate = 1;
+          mycon->deflatebits = bits;
+          mycon->deflatereset = reset;
+        }
+#endif
+        mycon->next = w->root;
+        if (w->root) {
+          w->root->prev = mycon;
+        }
+        w->root = mycon;
+        mgcon->fn_data = mycon;
+      }
 #ifdef EMBEDDEDFILE
     } else if (!rootdir) {
       const struct embeddedfile *f;
@@ -295,42 +2863,75 @@ static void fn(struct mg_connection *mgcon, int ev, void *ev_data, void *fn_data
   } else if (ev == MG_EV_WS_MSG) {
     // Got websocket frame.
     struct mg_ws_message *wm = (struct mg_ws_message *) ev_data;
-    if ((wm->flags & 0xF) == WEBSOCKET_OP_TEXT) {
-      // Find matching connection
-      struct mycon *mycon;
-      for (mycon=root;mycon;mycon=mycon->next) {
-        if (mycon->mgcon == mgcon) {
-          break;
-        }
-      }
-      if (!mycon) {
-        // Create new connection
-        mycon = calloc(sizeof(struct mycon), 1);
-        mycon->mgcon = mgcon;
-        mycon->next = root;
-        root = mycon;
-      }
-      if (mycon) {
-        mpd_send(mycon, (char *)wm->data.ptr, wm->data.len);
+    struct mycon *mycon = (struct mycon *) fn_data;
+    char *buf = (char *) wm->data.ptr, *tbuf = NULL;
+    size_t len = wm->data.len;
+#ifdef ZLIB
+    if ((wm->flags & 0x40) && mycon->deflate) {
+      // Compressed by the client
+      buf = tbuf = ws_inflate(mycon, buf, &len);
+    }
+#endif
+    if (!buf) {
+      mg_error(mgcon, "bad compressed message");
+    } else if ((wm->flags & 0xF) == WEBSOCKET_OP_TEXT) {
+      if (!tbuf && (unsigned char *) buf + len >= mgcon->recv.buf + mgcon->recv.size) {
+        // No room to terminate it
+        buf = tbuf = malloc(len + 1);
+        memcpy(buf, wm->data.ptr, len);
       }
+      // Frames aren't terminated and the next can follow straight on, as
+      // they do when the client pipelines, so terminate it while it's handled
+      char next = buf[len];
+      buf[len] = 0;
+      mpd_send(mycon, buf, len);
+      buf[len] = next;
     }
+    free(tbuf);
 
-  } else if (ev == MG_EV_CLOSE) {
-    struct mycon *mycon, *prev = NULL;
-    for (mycon=root;mycon;mycon=mycon->next) {
-      if (mycon->mgcon == mgcon) {
-        mpd_disconnect(mycon);
-        if (prev) {
-          prev->next = mycon->next;
-        } else {
-          root = mycon->next;
+  } else if (ev == MG_EV_WRITE && mgcon->is_websocket) {
+    mpd_checkdrained((struct mycon *) fn_data);
+
+  } else if (ev == MG_EV_CLOSE && mgcon->is_websocket) {
+    struct mycon *mycon = (struct mycon *) fn_data;
+    struct worker *w = mycon->worker;
+    mpd_disconnect(mycon);
+    if (mycon->prev) {
+      mycon->prev->next = mycon->next;
+    } else {
+      w->root = mycon->next;
+    }
+    if (mycon->next) {
+      mycon->next->prev = mycon->prev;
+    }
+    mg_iobuf_free(&mycon->batch);
+    mg_iobuf_free(&mycon->events);
+    mg_iobuf_free(&mycon->captured);
+    mg_iobuf_free(&mycon->held);
+    mg_iobuf_free(&mycon->tags);
+    if (mycon->json) {
+      for (int i=0;i<MAXKEYS;i++) {
+        if (i < mycon->json->nkeys) {
+          free(mycon->json->keys[i]);
         }
-        free(mycon);
-        mycon = NULL;
-        break;
+        mg_iobuf_free(&mycon->json->cur[i]);
+        mg_iobuf_free(&mycon->json->prev[i]);
       }
-      prev = mycon;
+      free(mycon->json->recordkey);
+      free(mycon->json);
+    }
+#ifdef ZLIB
+    if (mycon->zout) {
+      deflateEnd(mycon->zout);
+      free(mycon->zout);
+    }
+    if (mycon->zin) {
+      inflateEnd(mycon->zin);
+      free(mycon->zin);
     }
+#endif
+    free(mycon->out);
+    free(mycon);
   }
 }
 
@@ -339,6 +2940,7 @@ static void avahiResolveCallback(AvahiServiceResolver *r, AVAHI_GCC_UNUSED Avahi
   if (event == AVAHI_RESOLVER_FAILURE) {
     fprintf(stderr, "Avahi Resolver: Failed to resolve service '%s' of type '%s' in domain '%s': %s\n", name, type, domain, avahi_strerror(avahi_client_errno(avahi_service_resolver_get_client(r))));
   } else if (event == AVAHI_RESOLVER_FOUND) {
+    pthread_rwlock_wrlock(&hostlock);
     for (struct myhost *h=hostroot;h;h=h->next) {
       if (!strcmp(h->name, name) && !strcmp(h->host, host_name) && h->port == port) {
         name = NULL;
@@ -356,6 +2958,7 @@ static void avahiResolveCallback(AvahiServiceResolver *r, AVAHI_GCC_UNUSED Avahi
       host->next = hostroot;
       hostroot = host;
     }
+    pthread_rwlock_unlock(&hostlock);
   }
   avahi_service_resolver_free(r);
 }
@@ -375,18 +2978,22 @@ static void avahiBrowseCallback(AvahiServiceBrowser *b, AvahiIfIndex interface,
     printf("Avahi: remove name \"%s\"n", name);
 #endif      
     // Probably only one, but remove all just in case
+    pthread_rwlock_wrlock(&hostlock);
     struct myhost *prev = NULL, *next = NULL;
     for (struct myhost *h=hostroot;h;h=next) {
       next = h->next;
       if (!strcmp(h->name, name)) {
         if (!prev) {
           hostroot = h->next;
-          free(h);
         } else {
           prev->next = h->next;
         }
+        free(h);
+      } else {
+        prev = h;
       }
     }
+    pthread_rwlock_unlock(&hostlock);
   }
 }
 
@@ -399,6 +3006,55 @@ static void avahiClientCallback(AvahiClient *c, AvahiClientState state, AVAHI_GC
 }
 #endif
 
+/**
+ * Run one iteration of the worker's event loop, then write everything it queued for MPD
+ */
+/**
+ * Give up on clients whose lookup is taking too long. The lookup carries on,
+ * but nobody's interested in it now
+ */
+static void resolve_poll(struct worker *w) {
+  uint64_t now = mg_millis();
+  struct resolve *next;
+  for (struct resolve *r=w->resolving;r;r=next) {
+    next = r->next;
+    if (r->mycon && now > r->mycon->deadline) {
+      mpd_connect_failed(r->mycon, strerror(ETIMEDOUT));
+    }
+  }
+}
+
+static void worker_poll(struct worker *w, int ms) {
+  mg_mgr_poll(&w->mgr, ms);
+  time_t now = time(NULL);
+  while (w->pinghead && now - w->pinghead->ping > TIMEOUT) {
+    // Sending the ping moves it to the tail of the list
+    struct mycon *m = w->pinghead;
+    if (m->stalled || m->leader || m->pending || m->greeting || m->held.len || m->pinged) {
+      // Not idle, just waiting for MPD, the client or another's response
+      mpd_touch(m);
+      continue;
+    }
+    // Straight to MPD, as the client isn't owed a response to it
+    m->pinged = 1;
+    mpd_queue(m, "ping", 4);
+  }
+  while (w->outhead) {
+    mpd_flush(w->outhead);
+  }
+  pool_poll(w);
+  watch_poll(w);
+  resolve_poll(w);
+}
+
+static void *worker_run(void *arg) {
+  struct worker *w = (struct worker *) arg;
+  for (;;) {
+    worker_poll(w, 1000);
+  }
+  return NULL;
+}
+
 
 int main(int argc, char **argv) {
   int mpdport = 6600;
@@ -432,6 +3088,26 @@ int main(int argc, char **argv) {
        mpdport = atoi(argv[++i]);
     } else if (i + 1 < argc && (!strcmp("-p", argv[i]) || !strcmp("--port", argv[i]))) {
        port = atoi(argv[++i]);
+    } else if (i + 1 < argc && (!strcmp("-t", argv[i]) || !strcmp("--threads", argv[i])) && atoi(argv[i + 1]) > 0) {
+       threads = atoi(argv[++i]);
+    } else if (i + 1 < argc && !strcmp("--max-line", argv[i]) && atol(argv[i + 1]) > 0) {
+       maxline = atol(argv[++i]);
+    } else if (i + 1 < argc && !strcmp("--pool", argv[i]) && atoi(argv[i + 1]) >= 0) {
+       poolsize = atoi(argv[++i]);
+    } else if (i + 1 < argc && !strcmp("--cache", argv[i]) && atol(argv[i + 1]) >= 0) {
+       cachesize = atol(argv[++i]);
+    } else if (!strcmp("--no-library", argv[i])) {
+       uselibrary = 0;
+    } else if (i + 1 < argc && !strcmp("--library-dir", argv[i])) {
+       librarydir = strdup(argv[++i]);
+#ifdef ZLIB
+    } else if (i + 1 < argc && !strcmp("--deflate", argv[i]) && atoi(argv[i + 1]) >= 0 && atoi(argv[i + 1]) <= 9) {
+       deflatelevel = atoi(argv[++i]);
+    } else if (i + 1 < argc && !strcmp("--deflate-window", argv[i]) && atoi(argv[i + 1]) >= 9 && atoi(argv[i + 1]) <= 15) {
+       deflatewindow = atoi(argv[++i]);
+    } else if (!strcmp("--deflate-no-context-takeover", argv[i])) {
+       deflatereset = 1;
+#endif
 #ifdef AVAHI
     } else if (!strcmp("--no-zeroconf", argv[i])) {
        avahipoll = NULL;
@@ -440,6 +3116,11 @@ int main(int argc, char **argv) {
        printf("Usage: %s [-H|--mpd-host <hostname>] [-P|--mpd-port <port>]\n", argv[0]);
        printf("              [-N|--mpd-name <string>] [-b|--bind <localaddress>]\n");
        printf("              [-p|--port <port>] [-r|--root <directory>]\n");
+       printf("              [-t|--threads <n>] [--max-line <bytes>] [--pool <n>]\n");
+       printf("              [--cache <bytes>] [--no-library] [--library-dir <directory>]\n");
+#ifdef ZLIB
+       printf("              [--deflate <level>] [--deflate-window <bits>] [--deflate-no-context-takeover]\n");
+#endif
 #ifdef AVAHI
        printf("              [--no-zeroconf]\n");
 #endif
@@ -450,6 +3131,20 @@ int main(int argc, char **argv) {
        printf("       --mpd-name <string>          friendly-name of the MPD server. Must be specified before mpd-host (default: \"MDP\")\n");
        printf("       --port <port>                port to bind the webserver to (default: 8000)\n");
        printf("       --bind <localaddress>        local address to bind the webserver to (default: 0.0.0.0)\n");
+       printf("       --threads <n>                number of worker threads, each accepting its own share of clients (default: 1)\n");
+       printf("                                    each thread keeps its own pool, idle connections and copy of each library,\n");
+       printf("                                    about 240 bytes per song, unless --library-dir lets them share one\n");
+       printf("       --max-line <bytes>           longest line accepted from MPD. Longer lines fail the command (default: %d)\n", MAXLINE);
+       printf("       --pool <n>                   idle connections to keep to each MPD server, per thread, 0 for one per client (default: %d)\n", POOLSIZE);
+       printf("       --cache <bytes>              memory for responses to searches, split between the threads, used while a client is subscribed\n");
+       printf("                                    to changes from the server. 0 to disable (default: %d)\n", CACHESIZE);
+       printf("       --no-library                 don't keep a copy of each server's songs to answer searches with\n");
+       printf("       --library-dir <directory>    save each server's songs here, and use them after a restart if the database is unchanged\n");
+#ifdef ZLIB
+       printf("       --deflate <level>            compression level for permessage-deflate, 0 to disable (default: 6)\n");
+       printf("       --deflate-window <bits>      compression window size, 9-15 (default: 15)\n");
+       printf("       --deflate-no-context-takeover  compress each message on its own, which uses less memory\n");
+#endif
        printf("       --root <directory>           directory to serve static HTTP files from (default:");
 #ifdef EMBEDDEDFILE
        printf(" internal filesystem)\n");
@@ -475,10 +3170,27 @@ int main(int argc, char **argv) {
     rootdir = strdup(".");
   }
 #endif
+  // The cache size is a total, each worker gets its share
+  cachesize /= threads;
   char *ws_listen;
   asprintf(&ws_listen, "ws://%s:%d", bindaddr, port);
-  struct mg_mgr mgr;
-  mg_mgr_init(&mgr);
+  // Every worker listens on the same port, the kernel balances connections between them
+  struct worker *workers = calloc(threads, sizeof(struct worker));
+  for (int i=0;i<threads;i++) {
+    mg_mgr_init(&workers[i].mgr);
+    workers[i].mgr.reuseport = threads > 1;
+    if ((workers[i].pipe = mg_mkpipe(&workers[i].mgr, resolvefn, &workers[i], false)) < 0) {
+      fprintf(stderr, "Failed to create resolver pipe\n");
+      exit(1);
+    }
+    pthread_mutex_init(&workers[i].pipelock, NULL);
+    int one = 1;
+    setsockopt(workers[i].pipe, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (!mg_http_listen(&workers[i].mgr, ws_listen, fn, &workers[i])) {
+      fprintf(stderr, "Failed to listen at %s\n", ws_listen);
+      exit(1);
+    }
+  }
 #ifdef AVAHI
   AvahiClient *client = NULL;
   AvahiServiceBrowser *sb = NULL;
@@ -498,56 +3210,25 @@ int main(int argc, char **argv) {
   }
 #endif
   printf("Listening at ws://%s:%d/ws\n", bindaddr, port);
-  mg_http_listen(&mgr, ws_listen, fn, NULL);
+  for (int i=1;i<threads;i++) {
+    if (pthread_create(&workers[i].thread, NULL, worker_run, &workers[i])) {
+      perror("pthread_create");
+      exit(1);
+    }
+  }
 
-  // Event loop
-  struct pollfd *pollfds = NULL;
-  int fdcount = 0;
+  // Event loop for the first worker, which also services Avahi. MPD connections are
+  // wrapped by mongoose, so one epoll set covers everything
   for (;;) {
 #ifdef AVAHI
     if (avahipoll) {
       avahi_simple_poll_iterate(avahipoll, 0);
     }
+    // With no Avahi to service we only need to wake for pings
+    worker_poll(&workers[0], avahipoll ? 200 : 1000);
+#else
+    worker_poll(&workers[0], 1000);
 #endif
-    mg_mgr_poll(&mgr, 200);
-    time_t now = time(NULL);
-    int t = 0;
-    for (struct mycon *mycon=root;mycon;mycon=mycon->next) {
-      t++;
-      if (mycon->mpdfd && now - mycon->ping > TIMEOUT) {
-        char tbuf[5];
-        strcpy(tbuf, "ping");
-        mycon->pinged = 1;
-        mpd_send(mycon, tbuf, 5);
-      }
-    }
-    if (t) {
-      if (t > fdcount) {
-        if (pollfds) {
-          free(pollfds);
-        }
-        pollfds = calloc(t, sizeof(struct pollfd));
-        fdcount = t;
-      }
-      t = 0;
-      for (struct mycon *mycon=root;mycon;mycon=mycon->next) {
-        pollfds[t].fd = mycon->mpdfd;
-        pollfds[t].events = POLLIN;
-        pollfds[t].revents = 0;
-        t++;
-      }
-      if ((t=poll(pollfds, t, 200)) < 0) {
-        perror("poll");
-      } else if (t) {
-        t = 0;
-        for (struct mycon *mycon=root;mycon;mycon=mycon->next) {
-          if (pollfds[t].revents) {
-            mpd_poll(mycon);
-          }
-          t++;
-        }
-      }
-    }
   }
   return 0;
 }
@@ -402,6 +402,7 @@ void mg_error(struct mg_connection *c, const char *fmt, ...) {
   va_end(ap);
   MG_ERROR(("%lu %p %s", c->id, c->fd, buf));
   c->is_closing = 1;             // Set is_closing before sending MG_EV_CALL
+  mg_activate(c);
   mg_call(c, MG_EV_ERROR, buf);  // Let user handler to override it
 }
 
@@ -1446,6 +1447,7 @@ void mg_http_bauth(struct mg_connection *c, const char *user,
     n = mg_base64_final(buf, n);
     c->send.len += 21 + (size_t) n + 2;
     memcpy(&c->send.buf[c->send.len - 2], "\r\n", 2);
+    mg_activate(c);
   } else {
     MG_ERROR(("%lu %s cannot resize iobuf %d->%d ", c->id, c->label,
               (int) c->send.size, (int) need));
@@ -2435,6 +2437,13 @@ int mg_iobuf_init(struct mg_iobuf *io, size_t size, size_t align) {
 size_t mg_iobuf_add(struct mg_iobuf *io, size_t ofs, const void *buf,
                     size_t len) {
   size_t new_size = roundup(io->len + len, io->align);
+  // Grow geometrically so appending many small pieces, like a websocket
+  // frame per line, isn't quadratic. Only shrink once drained
+  if (new_size > io->size && new_size < io->size * 2) {
+    new_size = roundup(io->size * 2, io->align);
+  } else if (new_size < io->size && io->len > 0) {
+    new_size = io->size;
+  }
   mg_iobuf_resize(io, new_size);      // Attempt to resize
   if (new_size != io->size) len = 0;  // Resize failure, append nothing
   if (ofs < io->len) memmove(io->buf + ofs + len, io->buf + ofs, io->len - ofs);
@@ -3321,6 +3330,7 @@ struct mg_connection *mg_mqtt_listen(struct mg_mgr *mgr, const char *url,
 size_t mg_vprintf(struct mg_connection *c, const char *fmt, va_list *ap) {
   size_t old = c->send.len;
   mg_vxprintf(mg_pfn_iobuf, &c->send, fmt, ap);
+  mg_activate(c);
   return c->send.len - old;
 }
 
@@ -3437,6 +3447,20 @@ struct mg_connection *mg_alloc_conn(struct mg_mgr *mgr) {
   return c;
 }
 
+// With epoll, mg_mgr_poll() only visits connections that are ready or on
+// this list. Anything that gives an idle connection work must call this
+void mg_activate(struct mg_connection *c) {
+#if MG_ENABLE_EPOLL
+  if (!c->is_active) {
+    c->is_active = 1;
+    c->next_active = c->mgr->active;
+    c->mgr->active = c;
+  }
+#else
+  (void) c;
+#endif
+}
+
 void mg_close_conn(struct mg_connection *c) {
   mg_resolve_cancel(c);  // Close any pending DNS query
   LIST_DELETE(struct mg_connection, &c->mgr->conns, c);
@@ -3463,6 +3487,7 @@ struct mg_connection *mg_connect(struct mg_mgr *mgr, const char *url,
     MG_ERROR(("OOM"));
   } else {
     LIST_ADD_HEAD(struct mg_connection, &mgr->conns, c);
+    mg_activate(c);
     c->is_udp = (strncmp(url, "udp:", 4) == 0);
     c->fd = (void *) (size_t) MG_INVALID_SOCKET;
     c->fn = fn;
@@ -3506,6 +3531,7 @@ struct mg_connection *mg_wrapfd(struct mg_mgr *mgr, int fd,
     MG_EPOLL_ADD(c);
     mg_call(c, MG_EV_OPEN, NULL);
     LIST_ADD_HEAD(struct mg_connection, &mgr->conns, c);
+    mg_activate(c);
   }
   return c;
 }
@@ -3525,7 +3551,10 @@ void mg_mgr_free(struct mg_mgr *mgr) {
   struct mg_timer *tmp, *t = mgr->timers;
   while (t != NULL) tmp = t->next, free(t), t = tmp;
   mgr->timers = NULL;  // Important. Next call to poll won't touch timers
-  for (c = mgr->conns; c != NULL; c = c->next) c->is_closing = 1;
+  for (c = mgr->conns; c != NULL; c = c->next) {
+    c->is_closing = 1;
+    mg_activate(c);
+  }
   mg_mgr_poll(mgr, 0);
 #if MG_ENABLE_FREERTOS_TCP
   FreeRTOS_DeleteSocketSet(mgr->ss);
@@ -4101,6 +4130,7 @@ long mg_io_send(struct mg_connection *c, const void *buf, size_t len) {
 }
 
 bool mg_send(struct mg_connection *c, const void *buf, size_t len) {
+  mg_activate(c);
   if (c->is_udp) {
     long n = mg_io_send(c, buf, len);
     MG_DEBUG(("%lu %p %d:%d %ld err %d", c->id, c->fd, (int) c->send.len,
@@ -4181,6 +4211,14 @@ bool mg_open_listener(struct mg_connection *c, const char *url) {
                           sizeof(on)) != 0) {
       // "Using SO_REUSEADDR and SO_EXCLUSIVEADDRUSE"
       MG_ERROR(("exclusiveaddruse: %d", MG_SOCKET_ERRNO));
+#endif
+#if defined(SO_REUSEPORT)
+    } else if (c->mgr->reuseport &&
+               setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, (char *) &on,
+                          sizeof(on)) != 0) {
+      // Several managers, one per thread, listen on the same port and the
+      // kernel balances incoming connections between them
+      MG_ERROR(("reuseport: %d", MG_SOCKET_ERRNO));
 #endif
     } else if (bind(fd, &usa.sa, slen) != 0) {
       MG_ERROR(("bind: %d", MG_SOCKET_ERRNO));
@@ -4363,6 +4401,7 @@ static void accept_conn(struct mg_mgr *mgr, struct mg_connection *lsn) {
   } else {
     tomgaddr(&usa, &c->rem, sa_len != sizeof(usa.sin));
     LIST_ADD_HEAD(struct mg_connection, &mgr->conns, c);
+    mg_activate(c);
     c->fd = S2PTR(fd);
     MG_EPOLL_ADD(c);
     mg_set_non_blocking_mode(FD(c));
@@ -4452,6 +4491,24 @@ static bool skip_iotest(const struct mg_connection *c) {
          (can_read(c) == false && can_write(c) == false);
 }
 
+#if MG_ENABLE_EPOLL
+// Whether a connection needs visiting even when epoll has nothing for it
+static bool is_busy(struct mg_connection *c) {
+  struct mg_mgr *mgr = c->mgr;
+  unsigned events = EPOLLERR | EPOLLHUP | (c->is_full ? 0U : EPOLLIN);
+  if (can_write(c) || c->is_resolving || c->is_tls_hs || c->is_resp ||
+      c->is_draining || c->is_closing || mg_tls_pending(c) > 0) {
+    return true;
+  }
+  // DNS timeouts are checked on MG_EV_POLL
+  if ((c == mgr->dns4.c || c == mgr->dns6.c) && mgr->active_dns_requests) {
+    return true;
+  }
+  // Its interest set is out of date, and mg_iotest() must fix that
+  return FD(c) != MG_INVALID_SOCKET && events != c->epoll_events;
+}
+#endif
+
 static void mg_iotest(struct mg_mgr *mgr, int ms) {
 #if MG_ENABLE_FREERTOS_TCP
   struct mg_connection *c;
@@ -4471,17 +4528,21 @@ static void mg_iotest(struct mg_mgr *mgr, int ms) {
                     eSELECT_READ | eSELECT_EXCEPT | eSELECT_WRITE);
   }
 #elif MG_ENABLE_EPOLL
-  size_t max = 1;
-  for (struct mg_connection *c = mgr->conns; c != NULL; c = c->next) {
+  // Idle connections are off the active list, and left to epoll entirely.
+  // Readiness beyond MG_EPOLL_EVENTS is level-triggered, so it's seen next time
+  struct epoll_event evs[MG_EPOLL_EVENTS];
+  for (struct mg_connection *c = mgr->active; c != NULL; c = c->next_active) {
     c->is_readable = c->is_writable = 0;
     if (mg_tls_pending(c) > 0) ms = 1, c->is_readable = 1;
-    if (can_write(c)) MG_EPOLL_MOD(c, 1);
-    max++;
+    if (c->is_closing) ms = 0;
+    if (FD(c) != MG_INVALID_SOCKET && !c->is_resolving) {
+      MG_EPOLL_MOD(c, can_write(c));
+    }
   }
-  struct epoll_event *evs = (struct epoll_event *) alloca(max * sizeof(evs[0]));
-  int n = epoll_wait(mgr->epoll_fd, evs, (int) max, ms);
+  int n = epoll_wait(mgr->epoll_fd, evs, MG_EPOLL_EVENTS, ms);
   for (int i = 0; i < n; i++) {
     struct mg_connection *c = (struct mg_connection *) evs[i].data.ptr;
+    mg_activate(c);
     if (evs[i].events & EPOLLERR) {
       mg_error(c, "socket error");
     } else if (c->is_readable == 0) {
@@ -4587,9 +4648,21 @@ void mg_mgr_poll(struct mg_mgr *mgr, int ms) {
   now = mg_millis();
   mg_timer_poll(&mgr->timers, now);
 
-  for (c = mgr->conns; c != NULL; c = tmp) {
+#if MG_ENABLE_EPOLL
+  // Connections stay marked is_active while they're visited, so anything
+  // queued for them meanwhile is picked up by the busy check at the end
+  c = mgr->active;
+  mgr->active = NULL;
+#else
+  c = mgr->conns;
+#endif
+  for (; c != NULL; c = tmp) {
     bool is_resp = c->is_resp;
+#if MG_ENABLE_EPOLL
+    tmp = c->next_active;
+#else
     tmp = c->next;
+#endif
     mg_call(c, MG_EV_POLL, &now);
     if (is_resp && !c->is_resp) {
       long n = 0;
@@ -4613,7 +4686,16 @@ void mg_mgr_poll(struct mg_mgr *mgr, int ms) {
     }
 
     if (c->is_draining && c->send.len == 0) c->is_closing = 1;
-    if (c->is_closing) close_conn(c);
+    if (c->is_closing) {
+      close_conn(c);
+#if MG_ENABLE_EPOLL
+    } else if (is_busy(c)) {
+      c->next_active = mgr->active;
+      mgr->active = c;
+    } else {
+      c->is_active = c->is_readable = c->is_writable = 0;
+#endif
+    }
   }
 }
 #endif
@@ -5919,6 +6001,7 @@ size_t mg_ws_wrap(struct mg_connection *c, size_t len, int op) {
   memmove(p, p - header_len, len);             // Shift data
   memcpy(p - header_len, header, header_len);  // Prepend header
   mg_ws_mask(c, len);                          // Mask data
+  mg_activate(c);
 
   return c->send.len;
 }
@@ -609,6 +609,10 @@ struct timeval {
 #define MG_ENABLE_EPOLL 0
 #endif
 
+#ifndef MG_EPOLL_EVENTS
+#define MG_EPOLL_EVENTS 256  // Ready connections taken per epoll_wait()
+#endif
+
 #ifndef MG_ENABLE_FATFS
 #define MG_ENABLE_FATFS 0
 #endif
@@ -716,13 +720,20 @@ struct timeval {
 #define MG_EPOLL_ADD(c)                                                    \
   do {                                                                     \
     struct epoll_event ev = {EPOLLIN | EPOLLERR | EPOLLHUP, {c}};          \
+    c->epoll_events = ev.events;                                           \
     epoll_ctl(c->mgr->epoll_fd, EPOLL_CTL_ADD, (int) (size_t) c->fd, &ev); \
   } while (0)
-#define MG_EPOLL_MOD(c, wr)                                                \
-  do {                                                                     \
-    struct epoll_event ev = {EPOLLIN | EPOLLERR | EPOLLHUP, {c}};          \
-    if (wr) ev.events |= EPOLLOUT;                                         \
-    epoll_ctl(c->mgr->epoll_fd, EPOLL_CTL_MOD, (int) (size_t) c->fd, &ev); \
+// Only call epoll_ctl() when the interest set actually changes, and drop
+// EPOLLIN while the connection is full so level-triggered reads don't spin
+#define MG_EPOLL_MOD(c, wr)                                                  \
+  do {                                                                       \
+    struct epoll_event ev = {EPOLLERR | EPOLLHUP, {c}};                      \
+    if (!c->is_full) ev.events |= EPOLLIN;                                   \
+    if (wr) ev.events |= EPOLLOUT;                                           \
+    if (ev.events != c->epoll_events) {                                      \
+      c->epoll_events = ev.events;                                           \
+      epoll_ctl(c->mgr->epoll_fd, EPOLL_CTL_MOD, (int) (size_t) c->fd, &ev); \
+    }                                                                        \
   } while (0)
 #else
 #define MG_EPOLL_ADD(c)
@@ -1033,6 +1044,8 @@ struct mg_mgr {
   void *active_dns_requests;    // DNS requests in progress
   struct mg_timer *timers;      // Active timers
   int epoll_fd;                 // Used when MG_EPOLL_ENABLE=1
+  struct mg_connection *active; // Connections the next poll must visit
+  bool reuseport;               // Set SO_REUSEPORT on listening sockets
   void *priv;                   // Used by the MIP stack
   size_t extraconnsize;         // Used by the MIP stack
 #if MG_ENABLE_FREERTOS_TCP
@@ -1072,6 +1085,9 @@ struct mg_connection {
   unsigned is_resp : 1;        // Response is still being generated
   unsigned is_readable : 1;    // Connection is ready to read
   unsigned is_writable : 1;    // Connection is ready to write
+  unsigned is_active : 1;      // On struct mg_mgr :: active
+  unsigned epoll_events;       // Interest set registered with epoll
+  struct mg_connection *next_active;  // Linkage in struct mg_mgr :: active
 };
 
 void mg_mgr_poll(struct mg_mgr *, int ms);
@@ -1085,6 +1101,7 @@ struct mg_connection *mg_connect(struct mg_mgr *, const char *url,
 struct mg_connection *mg_wrapfd(struct mg_mgr *mgr, int fd,
                                 mg_event_handler_t fn, void *fn_data);
 void mg_connect_resolved(struct mg_connection *);
+void mg_activate(struct mg_connection *);
 bool mg_send(struct mg_connection *, const void *, size_t);
 size_t mg_printf(struct mg_connection *, const char *fmt, ...);
 size_t mg_vprintf(struct mg_connection *, const char *fmt, va_list *ap);
@@ -6,6 +6,9 @@
 class Context extends EventTarget {
     #ws                         // internal websocket connection
     #q = [];                    // internal queue of pending transmissions 
+    #tags = false;              // internal flag, true if the proxy tags responses so commands needn't wait
+    #ntag = 0;                  // internal count of tags used
+    #current;                   // internal entry in the queue that the response being received is for
     #lastActive;                // internal name of the last-active tracklist
     debug = ["tx"];             // debug flags. Can also set "rx"
     servers = [];               // list of Server objects
@@ -30,49 +33,30 @@ class Context extends EventTarget {
         this.#ws = new WebSocket(url);
         this.#ws.binaryType = "arraybuffer";
         this.#ws.addEventListener("message", (e) => {
-            const v = e.data;
-            const text = !(v instanceof ArrayBuffer);
-            let sv = v;
-            if (text) {
-                let i = v.indexOf(": ");
-                if (i) {
-                    sv = {key:v.substring(0, i), value: v.substring(i + 2), toString: () => { return v; }};
-                }
-            }
-            if (that.#q.length && that.#q[0].sent) {
-                let cmd = that.#q[0];
-                if (that.debug.includes("rx")) {
-                    console.debug("RX " + (text ? v : "<binary " + v.byteLength + " bytes>"));
-                }
-                let err = null;
-                if (text) {
-                    if (!v.length) {
-                        return;
-                    } else if (typeof(cmd.tx) == "string" && cmd.tx.startsWith("proxy-connect ") && v.startsWith("OK MPD ")) {
-                        cmd.rx.push({key:"hello", value:v, toString: () => { return v; }});
-                    } else if (v == "OK") {
-                        // noop
-                    } else if (v.startsWith("ACK ")) {
-                        console.warn((typeof(cmd.tx) == "string" ? cmd.tx : JSON.stringify(cmd.tx)) + " -> " + v);
-                        err = v.substring(4);
-                    } else {
-                        cmd.rx.push(sv);
-                        return;
-                    }
-                } else {
-                    cmd.rx.push({key:"binary", value:v, toString: () => { return "binary: <" + value.byteLength + " bytes>"; }});
-                    return;
+            if (typeof(e.data) == "string" && e.data.startsWith("proxy-changed: ")) {
+                // From "proxy-subscribe", so not part of any response
+                that.dispatchEvent(new CustomEvent("changed", { detail: e.data.substring(15) }));
+            } else if (typeof(e.data) == "string" && e.data.charAt(0) == "{") {
+                // With "proxy-format json", one frame holds many records
+                that.#rxjson(JSON.parse(e.data));
+            } else if (typeof(e.data) == "string" && e.data.includes("\n")) {
+                // With "proxy-format batch", one frame holds many lines
+                for (let v of e.data.split("\n")) {
+                    that.#rx(v);
                 }
-                that.#q.shift();
-                if (cmd.callback) {
-                    cmd.callback(err, cmd.rx);
-                }
-                that.#poll();
             } else {
-                that.dispatchEvent(new CustomEvent("orphanread", { data: sv }));
+                that.#rx(e.data);
             }
         });
         that.#ws.addEventListener("open", (e) => {
+            // Ask for responses in as few frames as possible, as records if
+            // we can. A proxy that doesn't support a format will fail the
+            // command, which does no harm
+            that.#q.unshift({tx:"proxy-format json", rx: [], sent: false});
+            that.#q.unshift({tx:"proxy-format batch", rx: [], sent: false});
+            // If the proxy tags the response to this, everything after it
+            // can be sent without waiting for the response before
+            that.#q.unshift({tx:"proxy-stats", rx: [], sent: false, probe: true});
             that.#poll();
         });
         that.#ws.addEventListener("close", (e) => {
@@ -107,27 +91,222 @@ class Context extends EventTarget {
     }
 
     /**
-     * Called when a TX is queued or an RX is complete, to send the next TX
+     * Called with each message received, or each line of a batched message
+     * @param v the line, or an ArrayBuffer for binary data
+     */
+    #rx(v) {
+        const text = !(v instanceof ArrayBuffer);
+        let sv = v;
+        if (text && v.startsWith("proxy-tag: ")) {
+            // The response that follows is to the command sent with this tag
+            const tag = v.substring(11);
+            this.#tags = true;
+            this.#current = this.#q.find((cmd) => cmd.sent && cmd.tag == tag);
+            this.#poll();
+            return;
+        }
+        if (text) {
+            let i = v.indexOf(": ");
+            if (i) {
+                sv = {key:v.substring(0, i), value: v.substring(i + 2), toString: () => { return v; }};
+            }
+        }
+        const cmd = this.#current || (this.#q.length && this.#q[0].sent ? this.#q[0] : null);
+        if (cmd) {
+            if (this.debug.includes("rx")) {
+                console.debug("RX " + (text ? v : "<binary " + v.byteLength + " bytes>"));
+            }
+            let err = null;
+            if (text) {
+                if (!v.length) {
+                    return;
+                } else if (typeof(cmd.tx) == "string" && cmd.tx.startsWith("proxy-connect ") && v.startsWith("OK MPD ")) {
+                    cmd.rx.push({key:"hello", value:v, toString: () => { return v; }});
+                } else if (v == "OK") {
+                    // noop
+                } else if (v.startsWith("ACK ") && cmd.probe) {
+                    // A proxy that doesn't know proxy-tag
+                    err = v.substring(4);
+                } else if (v.startsWith("ACK ")) {
+                    console.warn((typeof(cmd.tx) == "string" ? cmd.tx : JSON.stringify(cmd.tx)) + " -> " + v);
+                    err = v.substring(4);
+                } else {
+                    cmd.rx.push(sv);
+                    return;
+                }
+            } else {
+                cmd.rx.push({key:"binary", value:v, toString: () => { return "binary: <" + value.byteLength + " bytes>"; }});
+                return;
+            }
+            this.#q.splice(this.#q.indexOf(cmd), 1);
+            this.#current = null;
+            if (cmd.records && !cmd.json) {
+                cmd.rx = Context.group(cmd.rx);
+            }
+            if (cmd.callback) {
+                cmd.callback(err, cmd.rx);
+            }
+            this.#poll();
+        } else {
+            this.dispatchEvent(new CustomEvent("orphanread", { data: sv }));
+        }
+    }
+
+    /**
+     * Called with each message received with "proxy-format json". Each record
+     * is an array of values indexed by key, where null is a missing key, 0 is
+     * the same value as the previous record and an array is a repeated key
+     * @param m the parsed message: {keys:[], records:[], end:"OK"}, without end if more is to come
+     */
+    #rxjson(m) {
+        const cmd = this.#current || (this.#q.length && this.#q[0].sent ? this.#q[0] : null);
+        if (cmd) {
+            if (this.debug.includes("rx")) {
+                console.debug("RX <" + m.records.length + " records>");
+            }
+            cmd.json = true;
+            const keys = cmd.records ? m.keys.map((k) => k.toLowerCase()) : m.keys;
+            let prev = [];
+            for (let r of m.records) {
+                if (typeof(r) == "string") {
+                    if (!cmd.records) {
+                        cmd.rx.push({key:"", value:r, toString: () => { return r; }});
+                    }
+                    continue;
+                }
+                let record = {};
+                for (let i=0;i<r.length;i++) {
+                    let v = r[i] === 0 ? prev[i] : r[i];
+                    r[i] = v;
+                    if (v == null) {
+                        continue;
+                    }
+                    for (let value of (Array.isArray(v) ? v : [v])) {
+                        if (cmd.records) {
+                            record[keys[i]] = value;
+                        } else {
+                            const key = keys[i];
+                            cmd.rx.push({key:key, value:value, toString: () => { return key + ": " + value; }});
+                        }
+                    }
+                }
+                if (cmd.records) {
+                    cmd.rx.push(record);
+                }
+                prev = r;
+            }
+        } else {
+            // Nobody waiting, so pass each line on as it would have arrived
+            let prev = [];
+            for (let r of m.records) {
+                if (typeof(r) == "string") {
+                    this.#rx(r);
+                    continue;
+                }
+                for (let i=0;i<r.length;i++) {
+                    let v = r[i] = r[i] === 0 ? prev[i] : r[i];
+                    if (v != null) {
+                        for (let value of (Array.isArray(v) ? v : [v])) {
+                            this.#rx(m.keys[i] + ": " + value);
+                        }
+                    }
+                }
+                prev = r;
+            }
+        }
+        if (m.end !== undefined) {
+            this.#rx(m.end);
+        }
+    }
+
+    /**
+     * Group a response into records, for a proxy that doesn't send them. A
+     * record starts with the first key of the response, or any of file,
+     * directory or playlist if the first key is one of them
+     * @param rx the response as a list of {key:value}
+     * @return a list of records, each {key:value, key:value...} with lower case keys
+     */
+    static group(rx) {
+        const entities = ["file", "directory", "playlist"];
+        let records = [];
+        let record, first;
+        for (let l of rx) {
+            if (!l.key) {
+                continue;
+            }
+            if (first === undefined) {
+                first = l.key;
+            }
+            if (!record || l.key == first || (entities.includes(first) && entities.includes(l.key))) {
+                record = {};
+                records.push(record);
+            }
+            record[l.key.toLowerCase()] = l.value;
+        }
+        return records;
+    }
+
+    /**
+     * Split a response into the responses to each command of a list, as sent
+     * for "command_list_ok_begin" or "proxy-bootstrap"
+     * @param rx the response as a list of {key:value}
+     * @return a list of the responses ending "list_OK", without any after the last
+     */
+    static parts(rx) {
+        let parts = [];
+        let part = [];
+        for (let l of rx) {
+            if (String(l) == "list_OK") {
+                parts.push(part);
+                part = [];
+            } else {
+                part.push(l);
+            }
+        }
+        return parts;
+    }
+
+    /**
+     * Called when a TX is queued or an RX is complete, to send the next TX.
+     * Once the proxy is known to tag responses, every TX is sent at once,
+     * tagged so the response can be matched to it
      */
     #poll() {
-        if (this.#ws.readyState == 1 && this.#q.length && !this.#q[0].sent) {
-            const debug = this.debug.includes("tx");
-            const cmd = this.#q[0];
+        if (this.#ws.readyState != 1) {
+            return;
+        }
+        const debug = this.debug.includes("tx");
+        for (let cmd of this.#q) {
+            if (cmd.sent) {
+                if (!this.#tags) {
+                    return;
+                }
+                continue;
+            }
             cmd.sent = true;
+            let prefix = "";
+            if (this.#tags || cmd.probe) {
+                cmd.tag = String(this.#ntag++);
+                prefix = "proxy-tag " + cmd.tag + " ";
+            }
             if (typeof(cmd.tx) == "string") {
                 if (debug) {
                     console.debug("TX " + cmd.tx);
                 }
-                this.#ws.send(cmd.tx);
+                this.#ws.send(prefix + cmd.tx);
             } else {
                 cmd.tx.unshift("command_list_begin");
                 cmd.tx.push("command_list_end");
-                for (let s of cmd.tx) {
-                    if (debug) {
+                if (debug) {
+                    for (let s of cmd.tx) {
                         console.debug("TX " + s);
                     }
-                    this.#ws.send(s);
                 }
+                // One frame for the whole list, so the proxy writes it to MPD in one go
+                this.#ws.send(prefix + cmd.tx.join("\n"));
+            }
+            if (!this.#tags) {
+                return;
             }
         }
     }
@@ -154,6 +333,19 @@ class Context extends EventTarget {
         this.#poll();
     }
 
+    /**
+     * Queue a transmission whose response is a list of records, like a search
+     * @param cmd the command - a string
+     * @param callback callback function which will be called on completion with (error, [{key:value, key:value...}, ...]), keys in lower case
+     */
+    txRecords(cmd, callback) {
+        if (typeof(cmd) != "string") {
+            throw new Error("invalid cmd type");
+        }
+        this.#q.push({tx:cmd, rx: [], callback: callback, sent: false, records: true});
+        this.#poll();
+    }
+
     /**
      * Create a new Server
      * @param opts an object to initialise the server with
@@ -6,8 +6,20 @@
  */
 class Library extends TrackList {
 
-    filter = "\"(any contains \\\"\\\")\"";
+    static defaultFilter = "\"(any contains \\\"\\\")\"";
+    static firstWindow = 100;   // Tracks to ask for with "proxy-bootstrap", enough to fill the first screen
+    static prefetchDepth = 2;   // Screens of tracks to load ahead in the direction of scrolling. One is loaded behind
+    static prefetchBudget = 5000;       // Most tracks loaded ahead and not yet seen. The furthest away are dropped
+
+    filter = Library.defaultFilter;
+    prefetchHits = 0;   // Times the tracks scrolled to had been loaded ahead
+    prefetchMisses = 0; // ... and times some had to be waited for
     #loading;
+    #primed;            // internal {filter, count, search, tracks} from "proxy-bootstrap", used instead of asking again
+    #first = 0;         // internal first and last rows in view, to know which way it's scrolling
+    #last = -1;
+    #prefetched = new Set();    // internal rows loaded ahead and not yet seen
+    #inflight = [];     // internal [start, end] of rows being loaded ahead
 
     constructor(opts) {
         opts.type = "library";
@@ -15,6 +27,18 @@ class Library extends TrackList {
         this.sortkey = this.preferences.sortkey || "album";
     }
 
+    /**
+     * Give the library the responses from "proxy-bootstrap", which the first
+     * reload and the rows it loads use rather than asking again
+     * @param filter the filter searched for
+     * @param count the response to "searchcount" with that filter
+     * @param search the arguments to the search, as from Library.searchArgs()
+     * @param tracks the records from that search, from the first row
+     */
+    prime(filter, count, search, tracks) {
+        this.#primed = {filter: filter, count: count, search: search, tracks: tracks};
+    }
+
     /**
      * @Override
      */
@@ -24,7 +48,7 @@ class Library extends TrackList {
         }
         this.#loading = true;
         const that = this;
-        ctx.tx(ctx.countcmd + " " + this.filter, (err, rx) => {
+        const callback = (err, rx) => {
             if (err && ctx.countcmd == "searchcount") {
                 // fall back to "count"
                 ctx.countcmd = "count";
@@ -36,12 +60,26 @@ class Library extends TrackList {
                 if (l.key == "songs") {
                     that.tracks = [];
                     that.tracks.length = l.value * 1;
+                    that.#prefetched.clear();
+                    that.#inflight = [];
+                    that.#first = 0;
+                    that.#last = -1;
                     this.#loading = false;
                     this.dispatchEvent(new Event("load"));
                     that.rebuild();
                 }
             }
-        });
+        };
+        const primed = this.#primed;
+        if (primed && primed.count && primed.filter == this.filter) {
+            // Only the first time - after that, the count could have changed
+            const count = primed.count;
+            primed.count = null;
+            callback(null, count);
+        } else {
+            this.#primed = null;
+            ctx.tx(ctx.countcmd + " " + this.filter, callback);
+        }
     }
 
     /**
@@ -87,7 +125,131 @@ class Library extends TrackList {
      */
     loader(start, len) {
         const that = this;
-        let sortkey = that.sortkey;
+        const search = Library.searchArgs(this.filter, this.sortkey, this.reverse);
+        if (this.#primed && this.#primed.search == search) {
+            const tracks = this.#primed.tracks;
+            for (;len > 0 && start < tracks.length && start < this.tracks.length;start++, len--) {
+                that.set(start, tracks[start]);
+            }
+        }
+        // Rows being loaded ahead are drawn when they arrive
+        while (len > 0 && this.#loadingAhead(start)) {
+            start++;
+            len--;
+        }
+        while (len > 0 && this.#loadingAhead(start + len - 1)) {
+            len--;
+        }
+        if (len <= 0) {
+            return;
+        }
+        ctx.txRecords("search " + search + " window " + start + ":" + (start + len), (err, tracks) => {
+            for (let track of tracks) {
+                that.set(start++, track);
+            }
+        });
+    }
+
+    /**
+     * @Override
+     */
+    scrolled(first, last) {
+        const len = last - first + 1;
+        let missing = false, ahead = false;
+        for (let i=first;i<=last;i++) {
+            missing = missing || !this.tracks[i];
+            ahead = this.#prefetched.delete(i) || ahead;
+        }
+        const direction = first < this.#first ? -1 : 1;
+        if (first != this.#first || last != this.#last) {
+            if (missing) {
+                this.prefetchMisses++;
+            } else if (ahead) {
+                this.prefetchHits++;
+            }
+            if (ctx.debug.includes("prefetch")) {
+                console.debug("PREFETCH rows " + first + ".." + last + (missing ? " miss" : ahead ? " hit" : "") + ", " + this.prefetchHits + " hits " + this.prefetchMisses + " misses");
+            }
+        }
+        this.#first = first;
+        this.#last = last;
+        if (direction > 0) {
+            this.#prefetch(last + 1, last + 1 + Library.prefetchDepth * len);
+            this.#prefetch(first - len, first);
+        } else {
+            this.#prefetch(first - Library.prefetchDepth * len, first);
+            this.#prefetch(last + 1, last + 1 + len);
+        }
+    }
+
+    /**
+     * @param i the row
+     * @return true if the row is being loaded ahead
+     */
+    #loadingAhead(i) {
+        return this.#inflight.some((r) => i >= r[0] && i < r[1]);
+    }
+
+    /**
+     * Load the rows from start to end that aren't loaded or on their way, to
+     * have them ready when scrolled to
+     * @param start the first row
+     * @param end the row after the last
+     */
+    #prefetch(start, end) {
+        const that = this;
+        start = Math.max(start, 0);
+        end = Math.min(end, this.tracks.length);
+        while (start < end && (this.tracks[start] || this.#loadingAhead(start))) {
+            start++;
+        }
+        while (end > start && (this.tracks[end - 1] || this.#loadingAhead(end - 1))) {
+            end--;
+        }
+        if (start >= end) {
+            return;
+        }
+        const range = [start, end];
+        const tracks = this.tracks;
+        this.#inflight.push(range);
+        ctx.txRecords("search " + Library.searchArgs(this.filter, this.sortkey, this.reverse) + " window " + start + ":" + end, (err, rx) => {
+            if (tracks != that.tracks) {
+                return;         // Reloaded since
+            }
+            that.#inflight.splice(that.#inflight.indexOf(range), 1);
+            for (let track of rx) {
+                if (tracks[start]) {
+                    // Loaded while this was on its way
+                } else if (start >= that.#first && start <= that.#last) {
+                    // Scrolled to while this was on its way
+                    that.set(start, track);
+                } else {
+                    tracks[start] = track;
+                    that.#prefetched.add(start);
+                }
+                start++;
+            }
+            if (that.#prefetched.size > Library.prefetchBudget) {
+                // Drop the rows furthest from the view
+                const rows = [...that.#prefetched].sort((a,b) => Math.abs(b - that.#first) - Math.abs(a - that.#first));
+                for (let i of rows.slice(0, rows.length - Library.prefetchBudget)) {
+                    if (!tracks[i].row) {
+                        delete tracks[i];
+                    }
+                    that.#prefetched.delete(i);
+                }
+            }
+        });
+    }
+
+    /**
+     * The arguments to "search" for the library's rows, without the window
+     * @param filter the filter
+     * @param sortkey the column to sort on
+     * @param reverse true to reverse the sort
+     * @return the arguments
+     */
+    static searchArgs(filter, sortkey, reverse) {
         switch (sortkey) {
             case "album": sortkey = "albumsort"; break;
             case "artist": sortkey = "artistsort"; break;
@@ -102,23 +264,9 @@ class Library extends TrackList {
             case "duration": sortkey = "duration"; break;
             case "time": sortkey = "time"; break;
         }
-        if (that.reverse) {
+        if (reverse) {
             sortkey = "-" + sortkey;
         }
-        ctx.tx("search " + this.filter + " sort " + sortkey + " window " + start + ":" + (start + len), (err, rx) => {
-            let track;
-            for (let l of rx) {
-                if (l.key == "file") {
-                    if (track) {
-                        that.set(start++, track);
-                    }
-                    track = {};
-                }
-                track[l.key.toLowerCase()] = l.value;
-            }
-            if (track) {
-                that.set(start++, track);
-            }
-        });
+        return filter + " sort " + sortkey;
     }
 }
@@ -17,14 +17,24 @@ class Partition extends TrackList {
     #timer;             // internal 1s timer to update duration, track info etc
     #loading;           // internal boolean to indicate whether date load is in progress
     #playlistVersion;   // internal playlist version, as reported by the system. To monitor changes from other clients
+    #primed;            // internal responses from "proxy-bootstrap" by command, used instead of asking again
 
     constructor(opts) {
         opts.type = "partition";
         super(opts);
+        // Changes made by other clients, from "proxy-subscribe"
+        ctx.addEventListener("changed", (e) => {
+            if (this.server.activePartition == this && ["player", "mixer", "options", "playlist"].includes(e.detail)) {
+                this.reload();
+            }
+        });
     }
 
     activate(active) {  // override
         ctx.tx("partition \"" + ctx.esc(this.name) + "\"");
+        if (active) {
+            ctx.tx("proxy-subscribe \"" + ctx.esc(this.name) + "\"");
+        }
         super.activate(active);
     }
 
@@ -55,6 +65,15 @@ class Partition extends TrackList {
         }
     }
 
+    /**
+     * Give the partition the responses from "proxy-bootstrap", which the next
+     * reload uses rather than asking again
+     * @param primed map of command to response, "playlistinfo" as records
+     */
+    prime(primed) {
+        this.#primed = primed;
+    }
+
     /**
      * @Override
      */
@@ -64,9 +83,12 @@ class Partition extends TrackList {
         }
         this.#loading = true;
         const that = this;
+        const primed = this.#primed || {};
+        this.#primed = null;
+        const tx = (cmd, callback) => primed[cmd] ? callback(null, primed[cmd]) : ctx.tx(cmd, callback);
         if (!that.outputs) {
             that.outputs = [];
-            ctx.tx("outputs", (err,rx) => {
+            tx("outputs", (err,rx) => {
                 that.outputs.length = 0;
                 for (let l of rx) {
                     if (l.key == "outputid") {
@@ -78,7 +100,7 @@ class Partition extends TrackList {
                 that.dispatchEvent(new Event("outputlist"));
             });
         }
-        ctx.tx("replay_gain_status", (err,rx) => {
+        tx("replay_gain_status", (err,rx) => {
             for (let l of rx) {
                 if (l.key == "replay_gain_mode") {
                     if (l.value != that.replaygain) {
@@ -98,7 +120,7 @@ class Partition extends TrackList {
             }
             that.dispatchEvent(new Event("track"));
         }
-        ctx.tx("status", (err,rx) => {
+        tx("status", (err,rx) => {
             let single = 0, repeat = false, random = false, playstate = null, elapsed = 0, duration = 0, volume = 0, playlistVersion = 0, playlistLength = 0, track = 0;
             for (let l of rx) {
                 if (l.key == "volume") {
@@ -162,21 +184,9 @@ class Partition extends TrackList {
                 that.dispatchEvent(new Event("elapsed"));
             }
             if (playlistVersion != that.#playlistVersion) {
-                ctx.tx("playlistinfo", (err, rx) => {
-                    let track;
-                    let tracks = [];
-                    for (let l of rx) {
-                        if (l.key == "file") {
-                            if (track) {
-                                tracks.push(track);
-                            }
-                            track = {};
-                            track.index = tracks.length + 1;
-                        }
-                        track[l.key.toLowerCase()] = l.value;
-                    }
-                    if (track) {
-                        tracks.push(track);
+                const f = (err, tracks) => {
+                    for (let i=0;i<tracks.length;i++) {
+                        tracks[i].index = i + 1;
                     }
                     that.tracks = tracks;
                     tracks.sort((a,b)=> {
@@ -186,7 +196,12 @@ class Partition extends TrackList {
                     that.dispatchEvent(new Event("load"));
                     that.rebuild();
                     updateNowPlaying(that.track);
-                });
+                };
+                if (primed.playlistinfo) {
+                    f(null, primed.playlistinfo);
+                } else {
+                    ctx.txRecords("playlistinfo", f);
+                }
             } else {
                 that.#loading = false;
                 that.dispatchEvent(new Event("load"));
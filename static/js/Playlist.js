@@ -22,21 +22,9 @@ class Playlist extends TrackList {
         }
         this.#loading = true;
         const that = this;
-        ctx.tx("listplaylistinfo \"" + ctx.esc(this.name) + "\"", (err, rx) => {
-            let track;
-            let tracks = [];
-            for (let l of rx) {
-                if (l.key == "file") {
-                    if (track) {
-                        tracks.push(track);
-                    }
-                    track = {};
-                    track.index = tracks.length + 1;
-                }
-                track[l.key.toLowerCase()] = l.value;
-            }
-            if (track) {
-                tracks.push(track);
+        ctx.txRecords("listplaylistinfo \"" + ctx.esc(this.name) + "\"", (err, tracks) => {
+            for (let i=0;i<tracks.length;i++) {
+                tracks[i].index = i + 1;
             }
             that.tracks = tracks;
             tracks.sort((a,b)=> {
@@ -31,84 +31,166 @@ class Server extends EventTarget {
     connect() {
         const server = this;
         if (!ctx.active || ctx.active.server != this) {
-            ctx.tx("proxy-connect \"" + this.ctx.esc(this.name) + "\"", (err,rx) => {
-                if (!err) {
-                    if (ctx.active && ctx.active.server) {
-                        ctx.active.server.#disconnect();
-                    }
-
-                    ctx.tx("stats", (err,rx) => {
-                        for (let l of rx) {
-                            server[l.key] = l.value;
-                        }
-                    });
-                    ctx.tx("listpartitions", (err,rx) => {
-                        for (let l of rx) {
-                            if (l.key == "partition") {
-                                server.addPartition(l.value);
-                            }
+            // Everything needed to show the server in one response, with the
+            // library's first rows, if the proxy can
+            const preferences = ctx.preferences[this.id + "_Library"] || {};
+            const search = Library.searchArgs(Library.defaultFilter, preferences.sortkey || "album", preferences.reverse || false);
+            ctx.tx("proxy-bootstrap \"" + this.ctx.esc(this.name) + "\" " + search + " window 0:" + Library.firstWindow, (err,rx) => {
+                if (!rx.length || rx[0].key != "hello") {
+                    // Not connected, or a proxy without proxy-bootstrap
+                    server.#connectEach();
+                    return;
+                }
+                // A response for each command, as far as they got
+                const parts = Context.parts(rx);
+                server.#connected();
+                server.#use(parts[0], "stats", (rx) => server.#stats(rx));
+                server.#use(parts[1], "listpartitions", (rx) => server.#partitions(rx));
+                if (parts.length >= 7) {
+                    let name = "default";
+                    for (let l of parts[3]) {
+                        if (l.key == "partition") {
+                            name = l.value;
                         }
-                        ctx.tx("listplaylists", (err,rx) => {
-                            for (let l of rx) {
-                                if (l.key == "playlist") {
-                                    server.addPlaylist(l.value, true);
-                                }
-                            }
-                            document.querySelectorAll("#nav [data-for=\"" + server.id + "\"] [data-field=\"playlists\"]").forEach((e) => {
-                                let a = document.createElement("a");
-                                a.appendChild(document.createTextNode("Create New Playlist"));
-                                a.setAttribute("data-action", "newplaylist");
-                                e.appendChild(a);
-                            });
-                            if (!ctx.active) {
-                                // Called after partitions/playlists loaded
-                                ctx.activate(location.hash);
-                            }
-                        });
-                    });
+                    }
+                    const partition = server.partitions.find((p) => p.name == name);
+                    if (partition) {
+                        partition.prime({status: parts[3], outputs: parts[4], replay_gain_status: parts[5], playlistinfo: Context.group(parts[6])});
+                    }
+                }
+                if (parts.length >= 9) {
+                    server.library.prime(Library.defaultFilter, parts[7], search, Context.group(parts[8]));
+                }
+                server.#use(parts[2], "listplaylists", (rx) => server.#playlists(rx));
+                server.dispatchEvent(new Event("connect"));
+            });
+        }
+    }
 
-                    // Add library to main
-                    const tree = document.getElementById("library-template").cloneNode(true);
-                    document.getElementById("main").appendChild(tree);
-                    server.library = new Library({
-                        server: server,
-                        name: "Library",
-                        elt: tree,
-                        elt_table: tree.querySelector(".table")
-                    });
+    /**
+     * Connect to this server one command at a time, for a proxy without proxy-bootstrap
+     */
+    #connectEach() {
+        const server = this;
+        ctx.tx("proxy-connect \"" + this.ctx.esc(this.name) + "\"", (err,rx) => {
+            if (!err) {
+                server.#connected();
+                server.dispatchEvent(new Event("connect"));
+            } else {
+                server.connected = false;
+                server.failed = true;
+                console.log("server \"" + server.id + "\" connection failed");
+                server.dispatchEvent(new Event("connectfail"));
+            }
+        });
+        // Sent with proxy-connect, which they wait for if the proxy can't pipeline them
+        this.#use(null, "stats", (rx) => server.#stats(rx));
+        this.#use(null, "listpartitions", (rx) => server.#partitions(rx));
+        this.#use(null, "listplaylists", (rx) => server.#playlists(rx));
+    }
 
-                    // Populate nav
-                    document.querySelectorAll("#nav [data-for=\"" + server.id + "\"] [data-field=\"library\"]").forEach((e) => {
-                        let a = document.createElement("a");
-                        a.classList.add("library");
-                        a.href = "#" + server.library.id;
-                        a.innerHTML = server.library.name;
-                        a.trackList = server.library;
-                        a.setAttribute("data-for", server.library.id);
-                        e.appendChild(a);
-                    });
-                    // Populate fields
-                    tree.querySelectorAll("[data-action=\"filter\"]").forEach((e)=> {
-                        e.addEventListener("change", (e) => {
-                            server.library.filter = "\"(any contains \\\"" + e.target.value + "\\\")\"";
-                            server.library.reload();
-                        });
-                    });
-                    this.#addArtworkListener(tree, server.library);
-                    server.connected = true;
-                    server.failed = false;
-                    console.log("server \"" + server.id + "\" connected");
-                    server.dispatchEvent(new Event("connect"));
-                } else {
-                    server.connected = false;
-                    server.failed = true;
-                    console.log("server \"" + server.id + "\" connection failed");
-                    server.dispatchEvent(new Event("connectfail"));
+    /**
+     * Use a response from proxy-bootstrap, or ask for it if there wasn't one
+     * @param rx the response, or undefined
+     * @param cmd the command to ask with
+     * @param callback called with the response, unless asking for it fails
+     */
+    #use(rx, cmd, callback) {
+        if (rx) {
+            callback(rx);
+        } else {
+            ctx.tx(cmd, (err,rx) => {
+                if (!err) {
+                    callback(rx);
                 }
             });
         }
     }
 
+    /**
+     * Called once connected, to add the library
+     */
+    #connected() {
+        const server = this;
+        if (ctx.active && ctx.active.server) {
+            ctx.active.server.#disconnect();
+        }
+
+        // Add library to main
+        const tree = document.getElementById("library-template").cloneNode(true);
+        document.getElementById("main").appendChild(tree);
+        server.library = new Library({
+            server: server,
+            name: "Library",
+            elt: tree,
+            elt_table: tree.querySelector(".table")
+        });
+
+        // Populate nav
+        document.querySelectorAll("#nav [data-for=\"" + server.id + "\"] [data-field=\"library\"]").forEach((e) => {
+            let a = document.createElement("a");
+            a.classList.add("library");
+            a.href = "#" + server.library.id;
+            a.innerHTML = server.library.name;
+            a.trackList = server.library;
+            a.setAttribute("data-for", server.library.id);
+            e.appendChild(a);
+        });
+        // Populate fields
+        tree.querySelectorAll("[data-action=\"filter\"]").forEach((e)=> {
+            e.addEventListener("change", (e) => {
+                server.library.filter = "\"(any contains \\\"" + e.target.value + "\\\")\"";
+                server.library.reload();
+            });
+        });
+        this.#addArtworkListener(tree, server.library);
+        server.connected = true;
+        server.failed = false;
+        console.log("server \"" + server.id + "\" connected");
+    }
+
+    /**
+     * @param rx the response to "stats"
+     */
+    #stats(rx) {
+        for (let l of rx) {
+            this[l.key] = l.value;
+        }
+    }
+
+    /**
+     * @param rx the response to "listpartitions"
+     */
+    #partitions(rx) {
+        for (let l of rx) {
+            if (l.key == "partition") {
+                this.addPartition(l.value);
+            }
+        }
+    }
+
+    /**
+     * @param rx the response to "listplaylists"
+     */
+    #playlists(rx) {
+        const server = this;
+        for (let l of rx) {
+            if (l.key == "playlist") {
+                server.addPlaylist(l.value, true);
+            }
+        }
+        document.querySelectorAll("#nav [data-for=\"" + server.id + "\"] [data-field=\"playlists\"]").forEach((e) => {
+            let a = document.createElement("a");
+            a.appendChild(document.createTextNode("Create New Playlist"));
+            a.setAttribute("data-action", "newplaylist");
+            e.appendChild(a);
+        });
+        if (!ctx.active) {
+            // Called after partitions/playlists loaded
+            ctx.activate(location.hash);
+        }
+    }
+
     /**
      * Create a new playlist on the MPD server.
      * @param name the name of the Playlist
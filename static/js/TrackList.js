@@ -4,6 +4,7 @@
  * The TrackList is a generic list of Tracks
  * @param e the base element of the table
  * @param loader a function that takes (this, start, end) - loads tracks, calls set()
+ * @param scrolled an optional function that takes (first, last) - the rows in view, to load ahead of them
  */
 class TrackList extends EventTarget {
     server;             // The Server this TrackList is part of
@@ -43,7 +44,7 @@ class TrackList extends EventTarget {
         this.elt.id = this.id;
         this.elt_table = opts.elt_table;
         this.elt_table.trackList = this;
-        let sctimeout;
+        let sctimeout, scframe;
         const that = this;
         this.elt_table.classList.add("table");
         this.elt_table.addEventListener("scroll", function(e) {
@@ -51,6 +52,13 @@ class TrackList extends EventTarget {
                 clearTimeout(sctimeout);
             }
             sctimeout = setTimeout(()=>{that.#update()}, 400);
+            if (!scframe) {
+                // Rows already loaded are drawn straight away. Loading the rest waits until scrolling stops
+                scframe = requestAnimationFrame(()=>{
+                    scframe = null;
+                    that.#update(true);
+                });
+            }
         });
         this.#stylesheet = document.createElement("style");
         this.#stylesheet.setAttribute("data-for", this.id);
@@ -117,13 +125,15 @@ class TrackList extends EventTarget {
 
     /**
      * Called on resize or scroll to display visible rows
+     * @param drawOnly if true, only draw the rows already loaded
      */
-    #update() {
+    #update(drawOnly) {
         let style = window.getComputedStyle(this.elt_table, null);
         let padding = (style.paddingTop.replace(/px/, "")*1) + (style.paddingBottom.replace(/px/, "")*1);
         this.#offset = Math.floor(this.elt_table.scrollTop / this.#rowHeight);
         let start = this.#offset;
         let end = Math.min(this.tracks.length - 1, start + Math.ceil(this.elt_table.clientHeight / this.#rowHeight) - 1);;
+        const first = start, last = end;
 //        console.log("update: start="+start+" end="+end+" tracks="+this.tracks.length+" rowh="+this.#rowHeight);
 
         // Traverse children, replacing spacers with rows whre required.
@@ -208,9 +218,13 @@ class TrackList extends EventTarget {
             }
             end--;
         }
-        if (end >= start && this.loader) {
+        if (end >= start && this.loader && !drawOnly) {
             this.loader(start, end - start + 1);
         }
+        if (last >= first && this.scrolled && !drawOnly) {
+            // After loading what's in view, so that comes first
+            this.scrolled(first, last);
+        }
     }
 
     /**